@@ -29,7 +29,19 @@
 #include <string.h>
 #include <math.h>
 #include <limits.h>
+#include <time.h>
 
+#ifdef _OPENMP
+  #include <omp.h>
+#endif
+
+/* on x86-64 with gcc, build AVX2 and SSE4.2 versions of the distance
+ * kernel and pick one at load time, so one binary runs anywhere */
+#if defined(__GNUC__) && !defined(__clang__) && defined(__x86_64__) && defined(__linux__)
+  #define SIMD_CLONES __attribute__((target_clones("avx2","sse4.2","default")))
+#else
+  #define SIMD_CLONES
+#endif
 
 /* define a C preprocessor variable so that when structs.h is included,
  * it will contain extra information used only by this program */
@@ -91,6 +103,30 @@ int free_3d_array_b (unsigned char*** array, int nx, int ny, int nz){
    return(0);
 }
 
+float*** allocate_3d_array_f(int nx, int ny, int nz) {
+
+   // allocate an array of nx pointers, one for each plane, and always
+   //    allocate the floats plane-by-plane
+   float ***array = (float ***)malloc(nx * sizeof(float **));
+   for (int i=0; i<nx; i++) {
+      array[i] = (float **)malloc(ny * sizeof(float *));
+      array[i][0] = (float *)malloc((size_t)ny * nz * sizeof(float));
+      for (int j=1; j<ny; j++)
+         array[i][j] = array[i][0] + (size_t)j * nz;
+   }
+
+   return(array);
+}
+
+int free_3d_array_f (float*** array, int nx){
+   for (int i=0; i<nx; i++) {
+      free(array[i][0]);
+      free(array[i]);
+   }
+   free(array);
+   return(0);
+}
+
 unsigned char** allocate_2d_array_b(int nx, int ny) {
 
    unsigned char **array = (unsigned char **)malloc(nx * sizeof(unsigned char *));
@@ -107,15 +143,6 @@ int free_2d_array_b(unsigned char** array){
    return(0);
 }
 
-// define the possible output file types
-typedef enum output_format_type {
-   noout,       // default is no output
-   bob,         // brick of bytes (0..255)
-   bos,         // brock of shorts (0..65535)
-   bof          // brock of floats (IEEE floats)
-} OUT_FORMAT;
-
-
 /* Function to find minimum of x and y */
 int min(int x, int y)
 {
@@ -128,6 +155,34 @@ int max(int x, int y)
   return x ^ ((x ^ y) & -(x < y));
 }
 
+// define the possible output file types
+typedef enum output_format_type {
+   noout,       // default is no output
+   bob,         // brick of bytes (0..255)
+   bos,         // brock of shorts (0..65535)
+   bof,         // brock of floats (IEEE floats)
+   mesh         // triangles, contoured from the brick
+} OUT_FORMAT;
+
+
+/* wall-clock seconds, for throughput reports */
+static double wall_time() {
+#ifdef _OPENMP
+   return omp_get_wtime();
+#else
+   return (double)clock() / (double)CLOCKS_PER_SEC;
+#endif
+}
+
+/* which of the num_slabs slabs of x-planes (starting at slab_start[],
+ * with slab_start[num_slabs]==nx) holds plane i */
+static int slab_of (const int i, const int* slab_start, const int num_slabs, const int nx) {
+   int is = (int)(((long)i*num_slabs)/nx);
+   while (is < num_slabs-1 && slab_start[is+1] <= i) is++;
+   while (is > 0 && slab_start[is] > i) is--;
+   return is;
+}
+
 /*
  * Write a 3D brick of bytes
  */
@@ -147,6 +202,43 @@ int write_bob_file_from_uchar(FILE* ofp, unsigned char*** z, int nx, int ny, int
    return(0);
 }
 
+/* map n floats from 0..1 to shorts from 0..65535 */
+static void shorts_from_floats (const float* src, unsigned short* dst, const size_t n) {
+   for (size_t i=0; i<n; i++) {
+      const float val = fminf(fmaxf(src[i], 0.f), 1.f);
+      dst[i] = (unsigned short)(65535.f*val + 0.5f);
+   }
+}
+
+/*
+ * Write a 3D brick of floats, or of shorts (0..65535 for 0..1), one
+ * plane at a time
+ */
+int write_bob_file_from_float(FILE* ofp, float*** z, int nx, int ny, int nz, int as_shorts) {
+
+   /* write header */
+   fwrite(&nx,sizeof(int),1,ofp);
+   fwrite(&ny,sizeof(int),1,ofp);
+   fwrite(&nz,sizeof(int),1,ofp);
+
+   /* write the data */
+   const size_t np = (size_t)ny*nz;
+   unsigned short* splane = as_shorts ? (unsigned short*)malloc(np*sizeof(unsigned short)) : NULL;
+   for (int i=0; i<nx; i++) {
+      const float* src = &z[i][0][0];
+      if (as_shorts) {
+         shorts_from_floats(src, splane, np);
+         fwrite(splane,sizeof(unsigned short),np,ofp);
+      } else {
+         fwrite(src,sizeof(float),np,ofp);
+      }
+   }
+   free(splane);
+
+   /* return 0 if all went well */
+   return(0);
+}
+
 //
 // minimum distance from point to arbitrary triangle
 // code from Omegaflow v2, Surface.F90, function pointElemDistance3d
@@ -299,6 +391,119 @@ double mdtri(double x1x, double x1y, double x1z,
    return sqrt(minDist);
 }
 
+/*
+ * A triangle prepared for many distance queries: the same terms as
+ * mdtri, but computed once per triangle instead of once per voxel.
+ * Edge i runs from corner i to corner i+1.
+ */
+typedef struct tri_distance_record {
+   double v[3][3];	// corners
+   double e[3][3];	// edge vectors
+   double l[3];		// squared edge lengths
+   double n[3];		// unit normal
+   double c[3];		// centroid
+   double m[3][3];	// in-plane edge normals, pointing inward
+   double mv[3];	// m[i] dot v[i]
+   int has_face;	// zero for a degenerate (zero-area) triangle
+} TRI_DIST;
+
+static void prep_tri_dist (TRI_DIST* t,
+      double x1x, double x1y, double x1z,
+      double x2x, double x2y, double x2z,
+      double x3x, double x3y, double x3z) {
+
+   const double v[3][3] = {{x1x,x1y,x1z}, {x2x,x2y,x2z}, {x3x,x3y,x3z}};
+   for (int i=0; i<3; i++) {
+      const int ip = (i+1)%3;
+      for (int d=0; d<3; d++) {
+         t->v[i][d] = v[i][d];
+         t->e[i][d] = v[ip][d] - v[i][d];
+      }
+      t->l[i] = pow(t->e[i][0],2) + pow(t->e[i][1],2) + pow(t->e[i][2],2);
+   }
+
+   // normal and centroid exactly as mdtri finds them
+   const double ax = x2x-x3x, ay = x2y-x3y, az = x2z-x3z;
+   const double bx = x1x-x3x, by = x1y-x3y, bz = x1z-x3z;
+   const double rx = by*az - ay*bz;
+   const double ry = bz*ax - az*bx;
+   const double rz = bx*ay - ax*by;
+   const double rn = 1.0/sqrt(pow(rx,2) + pow(ry,2) + pow(rz,2));
+   t->n[0] = rx*rn;
+   t->n[1] = ry*rn;
+   t->n[2] = rz*rn;
+   t->c[0] = (x1x + x2x + x3x) / 3.0;
+   t->c[1] = (x1y + x2y + x3y) / 3.0;
+   t->c[2] = (x1z + x2z + x3z) / 3.0;
+   t->has_face = isfinite(rn);
+
+   // the prism over the face is bounded by three planes through the edges
+   for (int i=0; i<3; i++) {
+      const double* e = t->e[i];
+      const double* n = t->n;
+      double m[3] = {n[1]*e[2] - n[2]*e[1], n[2]*e[0] - n[0]*e[2], n[0]*e[1] - n[1]*e[0]};
+      const double* o = t->v[(i+2)%3];
+      const double side = m[0]*(o[0]-v[i][0]) + m[1]*(o[1]-v[i][1]) + m[2]*(o[2]-v[i][2]);
+      if (side < 0.0) for (int d=0; d<3; d++) m[d] = -m[d];
+      for (int d=0; d<3; d++) t->m[i][d] = m[d];
+      t->mv[i] = m[0]*v[i][0] + m[1]*v[i][1] + m[2]*v[i][2];
+   }
+}
+
+/* squared distance to the corner at the start of edge i, and to the
+ * edge itself if the point projects inside it, as in mdtri */
+static inline double corner_edge_dist (const TRI_DIST* t, const int i,
+      const double px, const double py, const double pz, double minDist) {
+
+   const double ax = px - t->v[i][0];
+   const double ay = py - t->v[i][1];
+   const double az = pz - t->v[i][2];
+   const double d = pow(ax,2) + pow(ay,2) + pow(az,2);
+   minDist = (d < minDist) ? d : minDist;
+
+   const double bx = t->e[i][0];
+   const double by = t->e[i][1];
+   const double bz = t->e[i][2];
+   const double rx = by*az - ay*bz;
+   const double ry = bz*ax - az*bx;
+   const double rz = bx*ay - ax*by;
+   const double rn = (pow(rx,2) + pow(ry,2) + pow(rz,2)) / t->l[i];
+   const double s = ( ax*bx + ay*by + az*bz ) / t->l[i];
+   return ((rn < minDist) & (s > 0.0) & (s < 1.0)) ? rn : minDist;
+}
+
+//
+// squared distances from the prepared triangle to a run of num points at
+// (px, py, pz0+k), for k=0..num-1; the squares of what mdtri returns for
+// each, but branch-free so the compiler runs 4 (AVX2) or 2 (SSE) points
+// at once (the sqrt is left to the caller, as it would not vectorize
+// without -fno-math-errno)
+//
+SIMD_CLONES
+static void mdtri_row (const TRI_DIST* restrict t, const double px, const double py,
+      const double pz0, const int num, double* restrict dist) {
+
+#pragma omp simd
+   for (int k=0; k<num; k++) {
+      const double pz = pz0 + (double)k;
+
+      // corners and edges
+      double minDist = 9.9e+9;
+      minDist = corner_edge_dist(t, 0, px, py, pz, minDist);
+      minDist = corner_edge_dist(t, 1, px, py, pz, minDist);
+      minDist = corner_edge_dist(t, 2, px, py, pz, minDist);
+
+      // the face, if the point is in the prism over it
+      const double rn = pow( t->n[0]*(px-t->c[0]) + t->n[1]*(py-t->c[1]) + t->n[2]*(pz-t->c[2]), 2 );
+      const int in_prism = (t->m[0][0]*px + t->m[0][1]*py + t->m[0][2]*pz >= t->mv[0]) &
+                           (t->m[1][0]*px + t->m[1][1]*py + t->m[1][2]*pz >= t->mv[1]) &
+                           (t->m[2][0]*px + t->m[2][1]*py + t->m[2][2]*pz >= t->mv[2]);
+      minDist = (t->has_face & in_prism & (rn < minDist)) ? rn : minDist;
+
+      dist[k] = minDist;
+   }
+}
+
 //
 // min dist code from
 // http://stackoverflow.com/questions/849211/shortest-distance-between-a-point-and-a-line-segment
@@ -336,20 +541,1543 @@ double minimum_distance(double vx, double vy, double vz,
   return sqrt( pow(jx-px,2) + pow(jy-py,2) + pow(jz-pz,2) );
 }
 
+// signed distance fields are exact within this many voxels of the mesh
+#define SDF_BAND 3.0
+// distance for voxels not yet reached by the sweeps
+#define SDF_FAR 1.e+30f
+
+//
+// does the column at (px,py), running along z, pass through the xy
+// projection of the triangle? if so, put the z of the crossing in zc
+//
+static int column_crossing (const double x1, const double y1, const double z1,
+                            const double x2, const double y2, const double z2,
+                            const double x3, const double y3, const double z3,
+                            const double px, const double py, double* zc) {
+
+   // twice the areas opposite each corner, in the xy plane
+   const double e1 = (x3-x2)*(py-y2) - (y3-y2)*(px-x2);
+   const double e2 = (x1-x3)*(py-y3) - (y1-y3)*(px-x3);
+   const double e3 = (x2-x1)*(py-y1) - (y2-y1)*(px-x1);
+
+   // strictly inside only: the columns are jittered off of the grid,
+   //    so hitting an edge or corner exactly is very unlikely
+   if ((e1 > 0.0 && e2 > 0.0 && e3 > 0.0) || (e1 < 0.0 && e2 < 0.0 && e3 < 0.0)) {
+      *zc = (e1*z1 + e2*z2 + e3*z3) / (e1+e2+e3);
+      return(1);
+   }
+   return(0);
+}
+
+static int compare_double (const void* a, const void* b) {
+   const double da = *(const double*)a;
+   const double db = *(const double*)b;
+   return (da > db) - (da < db);
+}
+
+//
+// one Godunov update of the eikonal equation |grad u| = 1 at voxel i,j,k,
+// in voxel units; returns the decrease in u
+//
+// frozen (exact) voxels carry a set sign bit, so read magnitudes only
+//
+static inline float eikonal_update (float*** u, const int nx, const int ny, const int nz,
+                                    const int i, const int j, const int k) {
+
+   const float old = u[i][j][k];
+   if (signbit(old)) return 0.f;
+
+   // smallest neighbor in each direction
+   float a = SDF_FAR, b = SDF_FAR, c = SDF_FAR;
+   if (i > 0) a = fabsf(u[i-1][j][k]);
+   if (i < nx-1) a = fminf(a, fabsf(u[i+1][j][k]));
+   if (j > 0) b = fabsf(u[i][j-1][k]);
+   if (j < ny-1) b = fminf(b, fabsf(u[i][j+1][k]));
+   if (k > 0) c = fabsf(u[i][j][k-1]);
+   if (k < nz-1) c = fminf(c, fabsf(u[i][j][k+1]));
+
+   // sort them so that a <= b <= c
+   float t;
+   if (a > b) { t = a; a = b; b = t; }
+   if (b > c) { t = b; b = c; c = t; }
+   if (a > b) { t = a; a = b; b = t; }
+   if (a >= SDF_FAR) return 0.f;
+
+   // solve with one, two, or three upwind neighbors
+   float unew = a + 1.f;
+   if (unew > b) {
+      unew = 0.5f * (a + b + sqrtf(2.f - (a-b)*(a-b)));
+      if (unew > c) {
+         const float s = a + b + c;
+         unew = (s + sqrtf(s*s - 3.f*(a*a + b*b + c*c - 1.f))) / 3.f;
+      }
+   }
+
+   if (unew < old) {
+      u[i][j][k] = unew;
+      return (old >= SDF_FAR) ? 1.f : old - unew;
+   }
+   return 0.f;
+}
+
+//
+// extend the distances in u out from the frozen voxels to the whole grid
+// with the fast sweeping method: Gauss-Seidel sweeps in all 8 diagonal
+// orderings, repeated until nothing changes
+//
+// each sweep visits the hyperplanes i+j+k=const in order; voxels in one
+// hyperplane never neighbor each other, so each is done in parallel, and
+// the result is the same as a plain nested-loop sweep (Detrixhe et al.),
+// which is what one thread does, as it is friendlier to the cache
+//
+static int sweep_distance (float*** u, const int nx, const int ny, const int nz) {
+
+   const int num_levels = nx + ny + nz - 2;
+   int num_passes = 0;
+   int num_threads = 1;
+#ifdef _OPENMP
+   num_threads = omp_get_max_threads();
+#endif
+
+   for (int pass=0; pass<20; pass++) {
+      num_passes++;
+      float maxchange = 0.f;
+
+      for (int dir=0; dir<8; dir++) {
+         const int fi = dir & 1;
+         const int fj = (dir >> 1) & 1;
+         const int fk = (dir >> 2) & 1;
+
+         if (num_threads == 1) {
+            for (int si=0; si<nx; si++) {
+               const int i = fi ? nx-1-si : si;
+               for (int sj=0; sj<ny; sj++) {
+                  const int j = fj ? ny-1-sj : sj;
+                  for (int sk=0; sk<nz; sk++) {
+                     const int k = fk ? nz-1-sk : sk;
+                     const float change = eikonal_update(u, nx, ny, nz, i, j, k);
+                     if (change > maxchange) maxchange = change;
+                  }
+               }
+            }
+            continue;
+         }
+
+         for (int lev=0; lev<num_levels; lev++) {
+            const int ilo = max(0, lev - (ny-1) - (nz-1));
+            const int ihi = min(nx-1, lev);
+            #pragma omp parallel for schedule(static) reduction(max:maxchange)
+            for (int si=ilo; si<=ihi; si++) {
+               const int i = fi ? nx-1-si : si;
+               const int jlo = max(0, lev - si - (nz-1));
+               const int jhi = min(ny-1, lev - si);
+               for (int sj=jlo; sj<=jhi; sj++) {
+                  const int j = fj ? ny-1-sj : sj;
+                  const int sk = lev - si - sj;
+                  const int k = fk ? nz-1-sk : sk;
+                  const float change = eikonal_update(u, nx, ny, nz, i, j, k);
+                  if (change > maxchange) maxchange = change;
+               }
+            }
+         }
+      }
+
+      fprintf(stderr,".");
+      fflush(stderr);
+
+      // updates only ever decrease u, so this will stop
+      if (maxchange < 1.e-4f) break;
+   }
+
+   return(num_passes);
+}
+
+//
+// turn the narrow band of unsigned distances (in voxels) into a signed
+// distance field over the whole grid (in world units, negative inside)
+//
+// the band is swept out to the rest of the grid, then the sign comes from
+// the parity of the mesh crossings above each voxel, along a z-column;
+// this needs a closed mesh, and uses the same slabs as the band did
+//
+static int finish_sdf (float*** sdf, const int nx, const int ny, const int nz,
+                       const double dx, const double* start,
+                       const tri_pointer* tri_list, const int num_tris,
+                       const int* slab_start, const int num_slabs,
+                       const size_t* slab_ptr, const int* slab_tris,
+                       const int* tri_imin, const int* tri_imax) {
+
+   // freeze the exact distances
+   #pragma omp parallel for
+   for (int i=0; i<nx; i++)
+      for (size_t jk=0; jk<(size_t)ny*nz; jk++)
+         if (sdf[i][0][jk] <= SDF_BAND) sdf[i][0][jk] = -sdf[i][0][jk];
+
+   fprintf(stderr,"Sweeping distances"); fflush(stderr);
+   double tstart = wall_time();
+   const int num_passes = sweep_distance(sdf, nx, ny, nz);
+   fprintf(stderr,"\n  %d passes in %g s\n", num_passes, wall_time()-tstart);
+   fflush(stderr);
+
+   // find where each triangle crosses each z-column: count, then fill
+   fprintf(stderr,"Finding inside and outside"); fflush(stderr);
+   tstart = wall_time();
+   const size_t num_cols = (size_t)nx*ny;
+   size_t* col_ptr = (size_t*)calloc(num_cols+1, sizeof(size_t));
+   size_t* col_fill = NULL;
+   double* col_z = NULL;
+
+   for (int fill=0; fill<2; fill++) {
+      #pragma omp parallel for schedule(dynamic,1)
+      for (int is=0; is<num_slabs; is++) {
+      for (size_t ip=slab_ptr[is]; ip<slab_ptr[is+1]; ip++) {
+         const int it = slab_tris[ip];
+         const tri_pointer tri = tri_list[it];
+
+         // scale the tri into grid coords
+         const double x1 = (tri->node[0]->loc.x - start[0]) / dx;
+         const double y1 = (tri->node[0]->loc.y - start[1]) / dx;
+         const double z1 = (tri->node[0]->loc.z - start[2]) / dx;
+         const double x2 = (tri->node[1]->loc.x - start[0]) / dx;
+         const double y2 = (tri->node[1]->loc.y - start[1]) / dx;
+         const double z2 = (tri->node[1]->loc.z - start[2]) / dx;
+         const double x3 = (tri->node[2]->loc.x - start[0]) / dx;
+         const double y3 = (tri->node[2]->loc.y - start[1]) / dx;
+         const double z3 = (tri->node[2]->loc.z - start[2]) / dx;
+
+         // only the columns in this slab
+         const int imin = max(tri_imin[it], slab_start[is]);
+         const int imax = min(tri_imax[it], slab_start[is+1]);
+         const int jmin = max((int)floor(fmin(y1, fmin(y2, y3))) - 1, 0);
+         const int jmax = min((int)ceil(fmax(y1, fmax(y2, y3))) + 1, ny);
+
+         for (int i=imin; i<imax; i++) {
+         for (int j=jmin; j<jmax; j++) {
+            double zc;
+            if (column_crossing(x1,y1,z1, x2,y2,z2, x3,y3,z3,
+                                (double)i+0.5+1.37e-6, (double)j+0.5+2.71e-6, &zc)) {
+               const size_t ic = (size_t)i*ny + j;
+               if (fill) col_z[col_fill[ic]++] = zc;
+               else col_ptr[ic+1]++;
+            }
+         }
+         }
+      }
+      }
+
+      // turn the counts into offsets
+      if (!fill) {
+         for (size_t ic=0; ic<num_cols; ic++) col_ptr[ic+1] += col_ptr[ic];
+         col_z = (double*)malloc((col_ptr[num_cols]+1)*sizeof(double));
+         col_fill = (size_t*)malloc(num_cols*sizeof(size_t));
+         memcpy(col_fill, col_ptr, num_cols*sizeof(size_t));
+      }
+   }
+   free(col_fill);
+
+   // a voxel is inside if an odd number of crossings are above it
+   long int num_inside = 0;
+   #pragma omp parallel for reduction(+:num_inside)
+   for (int i=0; i<nx; i++) {
+      for (int j=0; j<ny; j++) {
+         const size_t ic = (size_t)i*ny + j;
+         double* zc = col_z + col_ptr[ic];
+         const int nc = (int)(col_ptr[ic+1] - col_ptr[ic]);
+         qsort(zc, nc, sizeof(double), compare_double);
+
+         int above = nc;
+         int ic_lo = 0;
+         for (int k=0; k<nz; k++) {
+            while (ic_lo < nc && zc[ic_lo] < (double)k+0.5) { ic_lo++; above--; }
+            const float dist = fabsf(sdf[i][j][k]) * (float)dx;
+            if (above & 1) {
+               sdf[i][j][k] = -dist;
+               num_inside++;
+            } else {
+               sdf[i][j][k] = dist;
+            }
+         }
+      }
+   }
+   free(col_z);
+   free(col_ptr);
+
+   fprintf(stderr,"\n  %ld of %g voxels inside, %d tris in %g s\n", num_inside,
+           (double)nx*(double)ny*(double)nz, num_tris, wall_time()-tstart);
+   fflush(stderr);
+
+   return(0);
+}
+
+/*
+ * Filters for the finished brick, bytes (_b) and floats (_f)
+ */
+
+// smooth the brick in-place with diffuseSteps explicit diffusion steps
+//
+// each step is a 7-point average, weighted 6/12 to the center, Jacobi in
+// y and z but Gauss-Seidel in x (the -x neighbor is already updated);
+// edge planes, rows and columns do not change
+//
+// instead of one pass through the brick per step, up to DIFFUSE_FUSE steps
+// are fused into one pass: the brick is cut into tiles of DIFFUSE_ROWS
+// y-rows (plus a halo of one row per fused step, computed redundantly),
+// and each tile runs a wavefront along x, with step t working on the plane
+// 2 behind step t-1, each step keeping its last 3 planes in a small ring;
+// only the first step reads the brick, and only the last writes it, two
+// planes later, so tiles only need to stay within 2*fuse-1 planes of each
+// other, and the result is the same as one step at a time
+//
+#define DIFFUSE_FUSE 4
+#define DIFFUSE_ROWS 32
+
+// one row of one step, from the rows at -x, center, -y, +y, and +x
+static inline void diffuse_row_b (unsigned char* restrict out, const unsigned char* xm,
+      const unsigned char* c, const unsigned char* ym, const unsigned char* yp,
+      const unsigned char* xp, const int nz) {
+   out[0] = c[0];
+   out[nz-1] = c[nz-1];
+   for (int iz=1; iz<nz-1; iz++) {
+      const unsigned int neibsum = (unsigned int)c[iz+1] + (unsigned int)c[iz-1]
+                                 + (unsigned int)yp[iz] + (unsigned int)ym[iz]
+                                 + (unsigned int)xp[iz] + (unsigned int)xm[iz];
+      out[iz] = (unsigned char)((neibsum + 6*(unsigned int)c[iz] + 6) / 12);
+   }
+}
+
+static inline void diffuse_row_f (float* restrict out, const float* xm,
+      const float* c, const float* ym, const float* yp,
+      const float* xp, const int nz) {
+   out[0] = c[0];
+   out[nz-1] = c[nz-1];
+   for (int iz=1; iz<nz-1; iz++) {
+      const float neibsum = c[iz+1] + c[iz-1] + yp[iz] + ym[iz] + xp[iz] + xm[iz];
+      const float val = (neibsum + 6.f*c[iz]) / 12.f;
+      // the -x neighbor carries values down the whole brick, shrinking
+      //    12x per voxel; stop them before they turn denormal and slow
+      out[iz] = (val < 1.e-30f) ? 0.f : val;
+   }
+}
+
+// a row of plane p after "level" fused steps; edge planes and rows never
+//    change, and level 0 is the brick itself
+static inline unsigned char* diffuse_src (unsigned char** plane, unsigned char* ring,
+      const size_t rowb, const int nrows, const int nx, const int ny,
+      const int level, const int p, const int y, const int ey0) {
+   if (level == 0 || p == 0 || p == nx-1 || y == 0 || y == ny-1)
+      return plane[p] + (size_t)y*rowb;
+   return ring + ((size_t)((level-1)*3 + p%3)*nrows + (y-ey0))*rowb;
+}
+
+// plane[i] is the contiguous ny*nz plane i, of esize-byte voxels
+static void diffuse_blocked (unsigned char** plane, const int esize,
+      const int nx, const int ny, const int nz, const int diffuseSteps) {
+
+   if (nx < 3 || ny < 3 || nz < 3) return;
+
+   const size_t rowb = (size_t)nz*esize;
+   const int num_tiles = (ny-2 + DIFFUSE_ROWS-1) / DIFFUSE_ROWS;
+   const int nrows = DIFFUSE_ROWS + 2*DIFFUSE_FUSE;
+   const size_t ring_size = (size_t)DIFFUSE_FUSE*3*nrows*rowb;
+   unsigned char* rings = (unsigned char*)malloc(num_tiles*ring_size);
+
+   fprintf(stderr,"diffusing");
+   fflush(stderr);
+   const double tstart = wall_time();
+   for (int done=0; done<diffuseSteps; ) {
+      const int fuse = min(DIFFUSE_FUSE, diffuseSteps-done);
+
+      // step t finishes plane ix at sweep position ix+2*(t-1), and the last
+      //    plane is written out one position after it is finished
+      const int last = (nx-2) + 2*fuse - 1;
+      const int chunk = 2*fuse - 1;
+
+      #pragma omp parallel
+      for (int s0=1; s0<=last; s0+=chunk) {
+         #pragma omp for schedule(static)
+         for (int tile=0; tile<num_tiles; tile++) {
+            unsigned char* ring = rings + tile*ring_size;
+            const int ya = 1 + tile*DIFFUSE_ROWS;
+            const int yb = min(ya + DIFFUSE_ROWS, ny-1);
+            const int ey0 = max(0, ya - fuse);
+
+            for (int s=s0; s<min(s0+chunk, last+1); s++) {
+               for (int t=1; t<=fuse; t++) {
+                  const int ix = s - 2*(t-1);
+                  if (ix < 1 || ix > nx-2) continue;
+
+                  // this step's rows shrink by one per step into the tile
+                  const int r0 = max(ya - fuse + t, 1);
+                  const int r1 = min(yb + fuse - t, ny-1);
+                  for (int y=r0; y<r1; y++) {
+                     unsigned char* out = diffuse_src(plane, ring, rowb, nrows, nx, ny, t, ix, y, ey0);
+                     const unsigned char* xm = diffuse_src(plane, ring, rowb, nrows, nx, ny, t, ix-1, y, ey0);
+                     const unsigned char* c = diffuse_src(plane, ring, rowb, nrows, nx, ny, t-1, ix, y, ey0);
+                     const unsigned char* ym = diffuse_src(plane, ring, rowb, nrows, nx, ny, t-1, ix, y-1, ey0);
+                     const unsigned char* yp = diffuse_src(plane, ring, rowb, nrows, nx, ny, t-1, ix, y+1, ey0);
+                     const unsigned char* xp = diffuse_src(plane, ring, rowb, nrows, nx, ny, t-1, ix+1, y, ey0);
+                     if (esize == 1) diffuse_row_b(out, xm, c, ym, yp, xp, nz);
+                     else diffuse_row_f((float*)out, (const float*)xm, (const float*)c,
+                                        (const float*)ym, (const float*)yp, (const float*)xp, nz);
+                  }
+               }
+
+               // write back the tile's own rows of the finished plane
+               const int ixw = s - 2*fuse + 1;
+               if (ixw >= 1 && ixw <= nx-2) {
+                  for (int y=ya; y<yb; y++)
+                     memcpy(plane[ixw] + (size_t)y*rowb,
+                            diffuse_src(plane, ring, rowb, nrows, nx, ny, fuse, ixw, y, ey0), rowb);
+               }
+            }
+         }
+      }
+
+      done += fuse;
+      for (int t=0; t<fuse; t++) fprintf(stderr,".");
+      fflush(stderr);
+   }
+
+   free(rings);
+   const double tdiff = wall_time() - tstart;
+   fprintf(stderr,"\n  %d steps in %g s, %g voxels/s\n", diffuseSteps, tdiff,
+           (double)diffuseSteps*(double)nx*(double)ny*(double)nz/fmax(tdiff,1.e-9));
+   fflush(stderr);
+}
+
+static void diffuse_b (unsigned char*** dat, const int nx, const int ny, const int nz,
+      const int diffuseSteps) {
+   unsigned char** plane = (unsigned char**)malloc(nx*sizeof(unsigned char*));
+   for (int i=0; i<nx; i++) plane[i] = dat[i][0];
+   diffuse_blocked(plane, sizeof(unsigned char), nx, ny, nz, diffuseSteps);
+   free(plane);
+}
+
+static void diffuse_f (float*** dat, const int nx, const int ny, const int nz,
+      const int diffuseSteps) {
+   unsigned char** plane = (unsigned char**)malloc(nx*sizeof(unsigned char*));
+   for (int i=0; i<nx; i++) plane[i] = (unsigned char*)dat[i][0];
+   diffuse_blocked(plane, sizeof(float), nx, ny, nz, diffuseSteps);
+   free(plane);
+}
+
+// grow supports under overhangs steeper than repose degrees
+//
+// slice iz only depends on slice iz+1, so the slices are done from the top
+//    down, each one shared among threads by x-plane; to make a slice
+//    contiguous, every x-plane is first transposed from [iy][iz] to
+//    [iz][iy] (and back at the end), and each row is vectorized along iy
+
+// transpose each x-plane of esize-byte voxels from ny*nz to nz*ny, or back
+static void transpose_planes (unsigned char** plane, const int esize,
+      const int nx, const int ny, const int nz, const int to_slices) {
+
+   // rows and columns of the plane as it is now
+   const int nr = to_slices ? ny : nz;
+   const int nc = to_slices ? nz : ny;
+   const size_t psize = (size_t)ny*nz*esize;
+
+   #pragma omp parallel
+   {
+   unsigned char* buf = (unsigned char*)malloc(psize);
+   #pragma omp for schedule(static)
+   for (int ix=0; ix<nx; ix++) {
+      const unsigned char* src = plane[ix];
+      // in 32x32 tiles, to keep both sides in cache
+      for (int r0=0; r0<nr; r0+=32) {
+      for (int c0=0; c0<nc; c0+=32) {
+         const int r1 = min(r0+32, nr);
+         const int c1 = min(c0+32, nc);
+         if (esize == 1) {
+            for (int r=r0; r<r1; r++)
+               for (int c=c0; c<c1; c++)
+                  buf[(size_t)c*nr+r] = src[(size_t)r*nc+c];
+         } else {
+            for (int r=r0; r<r1; r++)
+               for (int c=c0; c<c1; c++)
+                  memcpy(buf + ((size_t)c*nr+r)*esize, src + ((size_t)r*nc+c)*esize, esize);
+         }
+      }
+      }
+      memcpy(plane[ix], buf, psize);
+   }
+   free(buf);
+   }
+}
+
+// the adjacent and diagonal weights for a repose angle
+static void repose_weights (const double repose, float* w) {
+   // depending on the angle (this should work for anything steeper than 45 degrees (45-90)
+   const float angle = (float)repose;
+   const float tana = tan((90.0-angle)*M_PI/180.0);
+   const float tast = tana/sqrt(2.0);
+   w[0] = tana;				// aw1
+   w[1] = 1.0-tana;			// aw2
+   w[2] = tast*tast;			// dw1
+   w[3] = tast*(1.0-tast);		// dw2
+   w[4] = (1.0-tast)*(1.0-tast);	// dw3
+}
+
+// one row of one slice: cur is row ix of slice iz, and um, uc, up are
+//    rows ix-1, ix, ix+1 of slice iz+1
+SIMD_CLONES
+static void repose_row_b (unsigned char* restrict cur, const unsigned char* um,
+      const unsigned char* uc, const unsigned char* up, const int ny, const float* w) {
+
+   const float aw1 = w[0], aw2 = w[1], dw1 = w[2], dw2 = w[3], dw3 = w[4];
+
+#pragma omp simd
+   for (int iy=1; iy<ny-1; ++iy) {
+      // enforce 45 degree angle (255 = inside object)
+      // linearly interpolate to find diagonal values (as they are farther than 1 dx away)
+      const int ne = (int)(dw1*(float)up[iy+1] + dw3*(float)uc[iy] +
+                           dw2*(float)up[iy] + dw2*(float)uc[iy+1]);
+      const int nw = (int)(dw1*(float)um[iy+1] + dw3*(float)uc[iy] +
+                           dw2*(float)um[iy] + dw2*(float)uc[iy+1]);
+      const int sw = (int)(dw1*(float)um[iy-1] + dw3*(float)uc[iy] +
+                           dw2*(float)um[iy] + dw2*(float)uc[iy-1]);
+      const int se = (int)(dw1*(float)up[iy-1] + dw3*(float)uc[iy] +
+                           dw2*(float)up[iy] + dw2*(float)uc[iy-1]);
+      // the adjacent columns are easier
+      const int nn = (int)(aw1*(float)uc[iy+1] + aw2*(float)uc[iy]);
+      const int ee = (int)(aw1*(float)up[iy] + aw2*(float)uc[iy]);
+      const int ww = (int)(aw1*(float)um[iy] + aw2*(float)uc[iy]);
+      const int ss = (int)(aw1*(float)uc[iy-1] + aw2*(float)uc[iy]);
+      const int xneib = (ee < ww) ? ee : ww;
+      const int yneib = (nn < ss) ? nn : ss;
+      const int aneib = (sw < ne) ? sw : ne;
+      const int bneib = (se < nw) ? se : nw;
+      const int hneib = (xneib < yneib) ? xneib : yneib;
+      const int dneib = (aneib < bneib) ? aneib : bneib;
+      const int allnb = (hneib < dneib) ? hneib : dneib;
+      const int currv = (int)cur[iy];
+      cur[iy] = (unsigned char)((currv > allnb) ? currv : allnb);
+   }
+}
+
+SIMD_CLONES
+static void repose_row_f (float* restrict cur, const float* um,
+      const float* uc, const float* up, const int ny, const float* w) {
+
+   const float aw1 = w[0], aw2 = w[1], dw1 = w[2], dw2 = w[3], dw3 = w[4];
+
+#pragma omp simd
+   for (int iy=1; iy<ny-1; ++iy) {
+      const float ne = dw1*up[iy+1] + dw3*uc[iy] + dw2*up[iy] + dw2*uc[iy+1];
+      const float nw = dw1*um[iy+1] + dw3*uc[iy] + dw2*um[iy] + dw2*uc[iy+1];
+      const float sw = dw1*um[iy-1] + dw3*uc[iy] + dw2*um[iy] + dw2*uc[iy-1];
+      const float se = dw1*up[iy-1] + dw3*uc[iy] + dw2*up[iy] + dw2*uc[iy-1];
+      const float nn = aw1*uc[iy+1] + aw2*uc[iy];
+      const float ee = aw1*up[iy] + aw2*uc[iy];
+      const float ww = aw1*um[iy] + aw2*uc[iy];
+      const float ss = aw1*uc[iy-1] + aw2*uc[iy];
+      const float xneib = (ee < ww) ? ee : ww;
+      const float yneib = (nn < ss) ? nn : ss;
+      const float aneib = (sw < ne) ? sw : ne;
+      const float bneib = (se < nw) ? se : nw;
+      const float hneib = (xneib < yneib) ? xneib : yneib;
+      const float dneib = (aneib < bneib) ? aneib : bneib;
+      const float allnb = (hneib < dneib) ? hneib : dneib;
+      cur[iy] = (cur[iy] > allnb) ? cur[iy] : allnb;
+   }
+}
+
+// plane[i] is the contiguous ny*nz plane i, of esize-byte voxels
+static void repose_slices (unsigned char** plane, const int esize,
+      const int nx, const int ny, const int nz, const double repose) {
+
+   fprintf(stderr,"Growing base to avoid overhangs\n"); fflush(stderr);
+   if (nx < 3 || ny < 3 || nz < 3) return;
+   const double tstart = wall_time();
+
+   float w[5];
+   repose_weights(repose, w);
+
+   transpose_planes(plane, esize, nx, ny, nz, TRUE);
+
+   // iterate through z-slices, from top to bottom
+   const size_t rowb = (size_t)ny*esize;
+   #pragma omp parallel
+   for (int iz=nz-2; iz>0; --iz) {
+      // for this layer, look up (+z) for data
+      #pragma omp for schedule(static)
+      for (int ix=1; ix<nx-1; ++ix) {
+         unsigned char* cur = plane[ix] + iz*rowb;
+         const unsigned char* um = plane[ix-1] + (iz+1)*rowb;
+         const unsigned char* uc = plane[ix] + (iz+1)*rowb;
+         const unsigned char* up = plane[ix+1] + (iz+1)*rowb;
+         if (esize == 1) repose_row_b(cur, um, uc, up, ny, w);
+         else repose_row_f((float*)cur, (const float*)um, (const float*)uc, (const float*)up, ny, w);
+      }
+   }
+
+   transpose_planes(plane, esize, nx, ny, nz, FALSE);
+
+   const double trep = wall_time() - tstart;
+   fprintf(stderr,"  %d slices in %g s, %g voxels/s\n", nz-2, trep,
+           (double)nx*(double)ny*(double)nz/fmax(trep,1.e-9));
+   fflush(stderr);
+}
+
+static void repose_b (unsigned char*** dat, const int nx, const int ny, const int nz,
+      const double repose) {
+   unsigned char** plane = (unsigned char**)malloc(nx*sizeof(unsigned char*));
+   for (int i=0; i<nx; i++) plane[i] = dat[i][0];
+   repose_slices(plane, sizeof(unsigned char), nx, ny, nz, repose);
+   free(plane);
+}
+
+static void repose_f (float*** dat, const int nx, const int ny, const int nz,
+      const double repose) {
+   unsigned char** plane = (unsigned char**)malloc(nx*sizeof(unsigned char*));
+   for (int i=0; i<nx; i++) plane[i] = (unsigned char*)dat[i][0];
+   repose_slices(plane, sizeof(float), nx, ny, nz, repose);
+   free(plane);
+}
+
+// shrink the volume by erode cells, one cell per pass; returns the
+//    array holding the result and frees the other
+//
+// each voxel drops toward each of its 26 neighbors in turn, by er/dist
+//    of the way, and keeps the lowest; a voxel only depends on the old
+//    array and on itself, so x-planes are shared among threads, and runs
+//    along z are done together, giving the same answer at any thread count
+
+// the 26 neighbor offsets, in i,j,k order, and their weights for erosion er
+static int erode_stencil (const double er, int* off, double* wgt) {
+   int n = 0;
+   for (int i=-1; i<2; ++i) {
+   for (int j=-1; j<2; ++j) {
+   for (int k=-1; k<2; ++k) {
+      const double dist = sqrt((double)(i*i+j*j+k*k));
+      if (dist > 0.1) {
+         off[3*n] = i;
+         off[3*n+1] = j;
+         off[3*n+2] = k;
+         wgt[n] = er/dist;
+         n++;
+      }
+   }
+   }
+   }
+   return(n);
+}
+
+// erode row iy of the x-plane pl[1] into out, which starts as a copy of
+//    it; pl[0] and pl[2] are the planes at -x and +x, all ny*nz (out is
+//    left without restrict: gcc vectorizes these loops better without it)
+SIMD_CLONES
+static void erode_row_b (unsigned char* out, const unsigned char* const* pl,
+      const int iy, const int nz, const int nnb, const int* off, const double* wgt) {
+   for (int n=0; n<nnb; ++n) {
+      // test vs value on interpolated line to this neighbor
+      const unsigned char* nb = pl[1+off[3*n]] + (size_t)(iy+off[3*n+1])*nz + off[3*n+2];
+      const double w = wgt[n];
+      for (int iz=1; iz<nz-1; ++iz) {
+         const unsigned char testval = w*nb[iz] + (1.0-w)*out[iz];
+         out[iz] = (testval < out[iz]) ? testval : out[iz];
+      }
+   }
+}
+
+SIMD_CLONES
+static void erode_row_f (float* out, const float* const* pl,
+      const int iy, const int nz, const int nnb, const int* off, const double* wgt) {
+   for (int n=0; n<nnb; ++n) {
+      const float* nb = pl[1+off[3*n]] + (size_t)(iy+off[3*n+1])*nz + off[3*n+2];
+      const float w = (float)wgt[n];
+      for (int iz=1; iz<nz-1; ++iz) {
+         const float testval = w*nb[iz] + (1.f-w)*out[iz];
+         out[iz] = (testval < out[iz]) ? testval : out[iz];
+      }
+   }
+}
+
+static unsigned char*** erode_b (unsigned char*** dat, const int nx, const int ny, const int nz,
+      const double erode) {
+
+   fprintf(stderr,"Eroding voxels\n"); fflush(stderr);
+
+   // first, allocate a copy of the 3d voxel array
+   unsigned char*** temp = allocate_3d_array_b (nx, ny, nz);
+
+   // and only erode one voxel at a time
+   for (int iter=0; iter<(int)(erode+0.999999); ++iter) {
+
+      double er = erode - (double)iter;
+      if (er > 1.0) er = 1.0;
+      fprintf(stderr,"  eroding %g\n", er); fflush(stderr);
+
+      int off[78];
+      double wgt[26];
+      const int nnb = erode_stencil(er, off, wgt);
+
+      #pragma omp parallel for schedule(dynamic,1)
+      for (int ix=0; ix<nx; ++ix) {
+         // copy the other array in first
+         for (int iy=0; iy<ny; ++iy) memcpy(temp[ix][iy], dat[ix][iy], nz);
+         if (ix == 0 || ix == nx-1) continue;
+
+         // then fill the middle with an eroded version
+         const unsigned char* pl[3] = {dat[ix-1][0], dat[ix][0], dat[ix+1][0]};
+         for (int iy=1; iy<ny-1; ++iy) erode_row_b(temp[ix][iy], pl, iy, nz, nnb, off, wgt);
+      }
+
+      // swap pointers to the two arrays
+      unsigned char*** swap = dat;
+      dat = temp;
+      temp = swap;
+   }
+
+   // return the finished array and delete the other
+   free_3d_array_b(temp, nx, ny, nz);
+   return(dat);
+}
+
+static float*** erode_f (float*** dat, const int nx, const int ny, const int nz,
+      const double erode) {
+
+   fprintf(stderr,"Eroding voxels\n"); fflush(stderr);
+   float*** temp = allocate_3d_array_f (nx, ny, nz);
+
+   // and only erode one voxel at a time
+   for (int iter=0; iter<(int)(erode+0.999999); ++iter) {
+
+      double er = erode - (double)iter;
+      if (er > 1.0) er = 1.0;
+      fprintf(stderr,"  eroding %g\n", er); fflush(stderr);
+
+      int off[78];
+      double wgt[26];
+      const int nnb = erode_stencil(er, off, wgt);
+
+      #pragma omp parallel for schedule(dynamic,1)
+      for (int ix=0; ix<nx; ++ix) {
+         memcpy(temp[ix][0], dat[ix][0], (size_t)ny*nz*sizeof(float));
+         if (ix == 0 || ix == nx-1) continue;
+
+         const float* pl[3] = {dat[ix-1][0], dat[ix][0], dat[ix+1][0]};
+         for (int iy=1; iy<ny-1; ++iy) erode_row_f(temp[ix][iy], pl, iy, nz, nnb, off, wgt);
+      }
+
+      // swap pointers to the two arrays
+      float*** swap = dat;
+      dat = temp;
+      temp = swap;
+   }
+
+   free_3d_array_f(temp, nx);
+   return(dat);
+}
+
+/*
+ * Marching cubes, from a dense brick of floats back to a triangle mesh
+ *
+ * Corner c of a cell is at (c&1, (c>>1)&1, (c>>2)&1) from its low corner,
+ * and edge e runs along axis e/4 (0=x, 1=y, 2=z) from the corner whose
+ * other two bits are e%4. A corner is inside if its value is above the
+ * level. The table of triangles for each of the 256 cases is built once,
+ * by walking the faces of the cube: on each face, the contour leaves every
+ * edge where the boundary (counter-clockwise from outside) goes from
+ * outside to inside, for the next edge where it goes back out, so faces
+ * with two diagonal inside corners keep them apart. That choice only
+ * depends on the face, so neighboring cells always agree and the mesh has
+ * no cracks. The loops found this way are fanned into triangles, which
+ * face away from the inside.
+ */
+
+// at most 12 edges in one loop, so 10 triangles and the -1
+#define MC_MAX 31
+static int mc_tris[256][MC_MAX];
+static int mc_ready = FALSE;
+
+// the edge between corners a and b, which differ in one bit
+static int mc_edge (const int a, const int b) {
+   const int c = a & b;
+   if ((a^b) == 1) return c>>1;
+   if ((a^b) == 2) return 4 + ((c&1) | (c>>1));
+   return 8 + c;
+}
+
+// the low corner of edge e
+static int mc_edge_corner (const int e) {
+   const int q = e & 3;
+   if (e < 4) return q<<1;
+   if (e < 8) return (q&1) | ((q&2)<<1);
+   return q;
+}
+
+// do edges e1 and e2 lie on a common face?
+static int mc_share_face (const int e1, const int e2) {
+   const int c1 = mc_edge_corner(e1);
+   const int c2 = mc_edge_corner(e2);
+   for (int d=0; d<3; d++)
+      if (d != e1/4 && d != e2/4 && ((c1>>d)&1) == ((c2>>d)&1)) return TRUE;
+   return FALSE;
+}
+
+static void mc_build_table () {
+
+   // corners of each face, counter-clockwise seen from outside
+   static const int face[6][4] = {{0,4,6,2}, {1,3,7,5}, {0,1,5,4},
+                                  {2,6,7,3}, {0,2,3,1}, {4,5,7,6}};
+
+   for (int m=0; m<256; m++) {
+      // which edge the contour goes to after each edge
+      int succ[12];
+      for (int e=0; e<12; e++) succ[e] = -1;
+      for (int f=0; f<6; f++) {
+         int edge[4], goes_in[4];
+         int n = 0;
+         for (int t=0; t<4; t++) {
+            const int a = face[f][t];
+            const int b = face[f][(t+1)%4];
+            if (((m>>a)&1) != ((m>>b)&1)) {
+               edge[n] = mc_edge(a, b);
+               goes_in[n] = (m>>b)&1;
+               n++;
+            }
+         }
+         for (int p=0; p<n; p++) {
+            if (!goes_in[p]) continue;
+            int q = (p+1)%n;
+            while (goes_in[q]) q = (q+1)%n;
+            succ[edge[p]] = edge[q];
+         }
+      }
+
+      // follow each loop, and fan it into triangles
+      int used[12] = {0};
+      int nt = 0;
+      for (int e0=0; e0<12; e0++) {
+         if (succ[e0] < 0 || used[e0]) continue;
+         int poly[12];
+         int len = 0;
+         int e = e0;
+         do {
+            poly[len++] = e;
+            used[e] = TRUE;
+            e = succ[e];
+         } while (e != e0);
+         // fan from a corner whose diagonals stay off the cube's faces; a
+         //    diagonal across a face with four crossings could be made the
+         //    same way by the cell on the other side
+         int apex = 0;
+         for (int a=0; a<len; a++) {
+            int ok = TRUE;
+            for (int t=2; t<len-1; t++)
+               if (mc_share_face(poly[a], poly[(a+t)%len])) ok = FALSE;
+            if (ok) {
+               apex = a;
+               break;
+            }
+         }
+         for (int t=1; t<len-1; t++) {
+            mc_tris[m][nt++] = poly[apex];
+            mc_tris[m][nt++] = poly[(apex+t)%len];
+            mc_tris[m][nt++] = poly[(apex+t+1)%len];
+         }
+      }
+      mc_tris[m][nt] = -1;
+   }
+   mc_ready = TRUE;
+}
+
+// the cases of the cells along row j of layer i, for k=0..nz-2; the four
+//    corners at each k give the low bits of one cell and the high of the last
+static void mc_row_cases (float*** f, const int i, const int j, const int nz,
+      const float level, unsigned char* cases) {
+   const float* r0 = f[i][j];
+   const float* r1 = f[i+1][j];
+   const float* r2 = f[i][j+1];
+   const float* r3 = f[i+1][j+1];
+   int q = (r0[0] > level) | ((r1[0] > level)<<1) | ((r2[0] > level)<<2) | ((r3[0] > level)<<3);
+   for (int k=0; k<nz-1; k++) {
+      const int qn = (r0[k+1] > level) | ((r1[k+1] > level)<<1) |
+                     ((r2[k+1] > level)<<2) | ((r3[k+1] > level)<<3);
+      cases[k] = (unsigned char)(q | (qn<<4));
+      q = qn;
+   }
+}
+
+// number of edges owned by x-plane i (its y- and z-edges, then, if
+//    with_x, the x-edges from it to plane i+1) that cross the level
+static long mc_count_plane (float*** f, const int i, const int ny, const int nz,
+      const float level, const int with_x) {
+   long cnt = 0;
+   for (int j=0; j<ny; j++) {
+      const float* r = f[i][j];
+      const float* ry = (j < ny-1) ? f[i][j+1] : r;
+      const float* rx = with_x ? f[i+1][j] : r;
+      for (int k=0; k<nz; k++) {
+         const int in = (r[k] > level);
+         cnt += (in != (ry[k] > level)) + (in != (rx[k] > level));
+         if (k < nz-1) cnt += (in != (r[k+1] > level));
+      }
+   }
+   return cnt;
+}
+
+// where the level crosses the edge from p0 (value f0) to p1 (value f1)
+static inline void mc_vertex (NODE* nd, const int index, const double* start, const double dx,
+      const int i, const int j, const int k, const int axis, const float f0, const float f1,
+      const float level) {
+   const double t = ((double)level - (double)f0) / ((double)f1 - (double)f0);
+   nd->index = index;
+   nd->loc.x = start[0] + dx*((double)i + 0.5 + ((axis == 0) ? t : 0.0));
+   nd->loc.y = start[1] + dx*((double)j + 0.5 + ((axis == 1) ? t : 0.0));
+   nd->loc.z = start[2] + dx*((double)k + 0.5 + ((axis == 2) ? t : 0.0));
+}
+
+// number the crossing y- and z-edges of plane i from *next, in the same
+//    order as mc_count_plane, into ey and ez; make their nodes if owned
+static void mc_number_plane (float*** f, const int i, const int ny, const int nz,
+      const float level, int* ey, int* ez, int* next, NODE* nodes,
+      const double* start, const double dx) {
+   for (int j=0; j<ny; j++) {
+      const float* r = f[i][j];
+      const float* ry = (j < ny-1) ? f[i][j+1] : r;
+      for (int k=0; k<nz; k++) {
+         const int in = (r[k] > level);
+         const size_t jk = (size_t)j*nz + k;
+         if (in != (ry[k] > level)) {
+            if (nodes) mc_vertex(&nodes[*next], *next, start, dx, i, j, k, 1, r[k], ry[k], level);
+            ey[jk] = (*next)++;
+         }
+         if (k < nz-1 && in != (r[k+1] > level)) {
+            if (nodes) mc_vertex(&nodes[*next], *next, start, dx, i, j, k, 2, r[k], r[k+1], level);
+            ez[jk] = (*next)++;
+         }
+      }
+   }
+}
+
+// the same for the x-edges from plane i to i+1
+static void mc_number_layer (float*** f, const int i, const int ny, const int nz,
+      const float level, int* ex, int* next, NODE* nodes, const double* start, const double dx) {
+   for (int j=0; j<ny; j++) {
+      const float* r = f[i][j];
+      const float* rx = f[i+1][j];
+      for (int k=0; k<nz; k++) {
+         if ((r[k] > level) != (rx[k] > level)) {
+            mc_vertex(&nodes[*next], *next, start, dx, i, j, k, 0, r[k], rx[k], level);
+            ex[(size_t)j*nz + k] = (*next)++;
+         }
+      }
+   }
+}
+
+//
+// contour the brick f at level into a new, welded triangle mesh, whose
+// nodes become the node list; voxel i,j,k is centered at
+// start + dx*(i+0.5, j+0.5, k+0.5)
+//
+// the cells are split into slabs of x-planes, one thread per slab, and
+// every crossing edge belongs to one slab: its x-edges, and the y- and
+// z-edges of its planes. A first pass counts each slab's nodes and
+// triangles; then each slab numbers its own nodes from its offset, in
+// plane order, and the nodes on the next slab's first plane, which it
+// shares, by scanning that plane with the next slab's offset. Nothing is
+// ever searched for, and the mesh is the same for any number of threads.
+//
+static tri_pointer contour_brick (float*** f, const int nx, const int ny, const int nz,
+      const double* start, const double dx, const float level) {
+
+   if (nx < 2 || ny < 2 || nz < 2) return NULL;
+   if (!mc_ready) mc_build_table();
+   int mc_ntri[256];
+   for (int m=0; m<256; m++) {
+      int n = 0;
+      while (mc_tris[m][n] >= 0) n++;
+      mc_ntri[m] = n/3;
+   }
+
+   fprintf(stderr,"Contouring brick at %g", level); fflush(stderr);
+   const double tstart = wall_time();
+
+   int num_threads = 1;
+#ifdef _OPENMP
+   num_threads = omp_get_max_threads();
+#endif
+   const int ncell = nx-1;
+   const int num_slabs = min(8*num_threads, ncell);
+   int slab_start[num_slabs+1];
+   for (int is=0; is<=num_slabs; is++) slab_start[is] = (int)(((long)is*ncell)/num_slabs);
+
+   // count each slab's nodes and triangles, then make room for them all
+   long node_off[num_slabs+1];
+   long tri_off[num_slabs+1];
+   node_off[0] = 0;
+   tri_off[0] = 0;
+   #pragma omp parallel
+   {
+   unsigned char* cases = (unsigned char*)malloc(nz);
+   #pragma omp for schedule(dynamic,1)
+   for (int is=0; is<num_slabs; is++) {
+      long nn = 0, nt = 0;
+      for (int i=slab_start[is]; i<slab_start[is+1]; i++) {
+         nn += mc_count_plane(f, i, ny, nz, level, TRUE);
+         for (int j=0; j<ny-1; j++) {
+            mc_row_cases(f, i, j, nz, level, cases);
+            for (int k=0; k<nz-1; k++) nt += mc_ntri[cases[k]];
+         }
+      }
+      if (is == num_slabs-1) nn += mc_count_plane(f, nx-1, ny, nz, level, FALSE);
+      node_off[is+1] = nn;
+      tri_off[is+1] = nt;
+   }
+   free(cases);
+   }
+   for (int is=0; is<num_slabs; is++) {
+      node_off[is+1] += node_off[is];
+      tri_off[is+1] += tri_off[is];
+   }
+   const long num_nodes = node_off[num_slabs];
+   const long num_tris = tri_off[num_slabs];
+   if (num_nodes > INT_MAX) {
+      fprintf(stderr,"\n  too many nodes (%ld), quitting.\n", num_nodes);
+      exit(1);
+   }
+   if (num_tris == 0) {
+      fprintf(stderr,"\n  no surface found\n");
+      return NULL;
+   }
+   // zeroed, so every field mc_vertex and the loop below leave alone
+   //    (connectivity, flow, lists) starts out empty for later utils
+   NODE* nodes = (NODE*)calloc(num_nodes, sizeof(NODE));
+   TRI* tris = (TRI*)calloc(num_tris, sizeof(TRI));
+   if (!nodes || !tris) {
+      fprintf(stderr,"\n  could not allocate %ld nodes and %ld triangles, quitting.\n", num_nodes, num_tris);
+      exit(1);
+   }
+
+   #pragma omp parallel
+   {
+   // numbers of the crossing edges: y and z on this plane and the next,
+   //    and x in between
+   const size_t np = (size_t)ny*nz;
+   int* ey[2] = {(int*)malloc(np*sizeof(int)), (int*)malloc(np*sizeof(int))};
+   int* ez[2] = {(int*)malloc(np*sizeof(int)), (int*)malloc(np*sizeof(int))};
+   int* ex = (int*)malloc(np*sizeof(int));
+   unsigned char* cases = (unsigned char*)malloc(nz);
+
+   #pragma omp for schedule(dynamic,1)
+   for (int is=0; is<num_slabs; is++) {
+      int next = (int)node_off[is];
+      long it = tri_off[is];
+      mc_number_plane(f, slab_start[is], ny, nz, level, ey[0], ez[0], &next, nodes, start, dx);
+
+      for (int i=slab_start[is]; i<slab_start[is+1]; i++) {
+         const int cur = (i - slab_start[is]) & 1;
+         mc_number_layer(f, i, ny, nz, level, ex, &next, nodes, start, dx);
+         if (i+1 < slab_start[is+1] || is == num_slabs-1) {
+            mc_number_plane(f, i+1, ny, nz, level, ey[1-cur], ez[1-cur], &next, nodes, start, dx);
+         } else {
+            int shared = (int)node_off[is+1];
+            mc_number_plane(f, i+1, ny, nz, level, ey[1-cur], ez[1-cur], &shared, NULL, start, dx);
+         }
+
+         for (int j=0; j<ny-1; j++) {
+         mc_row_cases(f, i, j, nz, level, cases);
+         for (int k=0; k<nz-1; k++) {
+            const int m = cases[k];
+            for (int t=0; mc_tris[m][t] >= 0; t+=3) {
+               TRI* tri = &tris[it++];
+               for (int c=0; c<3; c++) {
+                  const int e = mc_tris[m][t+c];
+                  const int lo = mc_edge_corner(e);
+                  const size_t jk = (size_t)(j + ((lo>>1)&1))*nz + k + ((lo>>2)&1);
+                  int id;
+                  if (e < 4) id = ex[jk];
+                  else if (e < 8) id = ey[(lo&1) ? 1-cur : cur][jk];
+                  else id = ez[(lo&1) ? 1-cur : cur][jk];
+                  tri->node[c] = &nodes[id];
+                  tri->norm[c] = NULL;
+                  tri->texture[c] = NULL;
+                  tri->adjacent[c] = NULL;
+                  tri->midpoint[c] = NULL;
+               }
+               tri->index = (int)(it-1);
+               tri->next_tri = (it < num_tris) ? &tris[it] : NULL;
+            }
+         }
+         }
+      }
+      fprintf(stderr,".");
+      fflush(stderr);
+   }
+   free(ey[0]);
+   free(ey[1]);
+   free(ez[0]);
+   free(ez[1]);
+   free(ex);
+   free(cases);
+   }
+
+   // the new nodes replace the old list
+   for (long n=0; n<num_nodes; n++) nodes[n].next_node = (n+1 < num_nodes) ? &nodes[n+1] : NULL;
+   node_head = nodes;
+
+   fprintf(stderr,"\n  %ld nodes, %ld triangles in %g s\n", num_nodes, num_tris, wall_time()-tstart);
+   fflush(stderr);
+   return tris;
+}
+
+/*
+ * Set the output format from its key: a brick, or any mesh format that
+ * write_output knows
+ */
+static OUT_FORMAT bob_format (const char* output_format) {
+   static const char* mesh_keys[] = {"obj", "raw", "tin", "rad", "pov", "rib", "wrl", NULL};
+   if (strncmp(output_format, "bob", 3) == 0) return bob;
+   if (strncmp(output_format, "bos", 3) == 0) return bos;
+   if (strncmp(output_format, "bof", 3) == 0) return bof;
+   for (const char** key = mesh_keys; *key; key++)
+      if (strncmp(output_format, *key, 3) == 0) return mesh;
+   fprintf(stderr,"WARNING (write_bob): output file format (%s)\n",output_format);
+   fprintf(stderr,"  unrecognized. Writing bob by default.\n");
+   return bob;
+}
+
+/*
+ * Filter a dense brick (dat for bob, fdat otherwise) and write it out,
+ * or contour it into *contour; frees the brick
+ */
+static int finish_bob (unsigned char*** dat, float*** fdat, const int nx, const int ny,
+      const int nz, const double* start, const double dx, const int diffuseSteps,
+      const double repose, const double erode, const OUT_FORMAT outType, tri_pointer* contour) {
+
+   // optionally diffuse the brick-of-whatevers
+   if (diffuseSteps > 0) {
+      if (dat) diffuse_b(dat, nx, ny, nz, diffuseSteps);
+      else diffuse_f(fdat, nx, ny, nz, diffuseSteps);
+   }
+
+   // then, expand to allow 3D printing
+   if (repose > 0.0 && repose < 90.1) {
+      if (dat) repose_b(dat, nx, ny, nz, repose);
+      else repose_f(fdat, nx, ny, nz, repose);
+   }
+
+   // grow or shrink uniformly, also called dilate/erode
+   if (erode > 0.0) {
+      if (dat) dat = erode_b(dat, nx, ny, nz, erode);
+      else fdat = erode_f(fdat, nx, ny, nz, erode);
+   }
+
+   // finally, print the image, or turn it back into triangles
+   if (outType == mesh) {
+      *contour = contour_brick(fdat, nx, ny, nz, start, dx, 0.5f);
+   } else if (outType == bob) {
+      fprintf(stderr,"Writing BOB file"); fflush(stderr);
+
+      // finally, write the file
+      FILE *ofp = stdout;
+      (void) write_bob_file_from_uchar(ofp, dat, nx, ny, nz);
+
+      fprintf(stderr,"\n");
+      fflush(stderr);
+   } else {
+      fprintf(stderr,"Writing %s file", (outType == bos) ? "BOS" : "BOF"); fflush(stderr);
+
+      // stream it out plane by plane, converting as we go
+      (void) write_bob_file_from_float(stdout, fdat, nx, ny, nz, outType == bos);
+
+      fprintf(stderr,"\n");
+      fflush(stderr);
+   }
+
+   // free the memory and return
+   if (dat) free_3d_array_b(dat, nx, ny, nz);
+   else free_3d_array_f(fdat, nx);
+   return(0);
+}
+
+/*
+ * Read a brick of bytes, shorts, or floats (from the .bob, .bos, or .bof
+ * extension), filter it, and write it out again, or contour it into *contour
+ *
+ * "dx" is the voxel size, default 1, and the low bounds in xb, yb, and zb,
+ * if given, are the corner of the brick, default 0
+ */
+int write_bob_from_brick (char* infile, double *xb, double *yb, double *zb,
+      double dx, int diffuseSteps, double repose, double erode,
+      char* output_format, tri_pointer* contour) {
+
+   const OUT_FORMAT outType = bob_format(output_format);
+   const char* ext = infile + strlen(infile) - 3;
+   int esize = sizeof(unsigned char);
+   if (strncmp(ext, "bos", 3) == 0) esize = sizeof(unsigned short);
+   else if (strncmp(ext, "bof", 3) == 0) esize = sizeof(float);
+
+   FILE* ifp = fopen(infile, "rb");
+   if (ifp == NULL) {
+      fprintf(stderr,"Could not open input file %s\n",infile);
+      exit(1);
+   }
+   int nx, ny, nz;
+   if (fread(&nx,sizeof(int),1,ifp) != 1 || fread(&ny,sizeof(int),1,ifp) != 1 ||
+       fread(&nz,sizeof(int),1,ifp) != 1 || nx < 1 || ny < 1 || nz < 1 ||
+       nx > 100000 || ny > 100000 || nz > 100000) {
+      fprintf(stderr,"Could not read brick size from %s, quitting.\n",infile);
+      exit(1);
+   }
+   fprintf(stderr,"Reading brick from %s\n",infile);
+   fprintf(stderr,"  brick is %d x %d x %d\n",nx,ny,nz);
+
+   if (dx < 0.0) dx = 1.0;
+   const double start[3] = {(xb[0] > 0.0) ? xb[1] : 0.0, (yb[0] > 0.0) ? yb[1] : 0.0,
+                            (zb[0] > 0.0) ? zb[1] : 0.0};
+
+   // bob is filtered in bytes, everything else in floats (0..1)
+   unsigned char*** dat = NULL;
+   float*** fdat = NULL;
+   if (outType == bob) dat = allocate_3d_array_b (nx, ny, nz);
+   else fdat = allocate_3d_array_f (nx, ny, nz);
+
+   const size_t np = (size_t)ny*nz;
+   unsigned char* plane = (unsigned char*)malloc(np*esize);
+   for (int i=0; i<nx; i++) {
+      if (fread(plane, esize, np, ifp) != np) {
+         fprintf(stderr,"Brick file %s is short, quitting.\n",infile);
+         exit(1);
+      }
+      for (size_t jk=0; jk<np; jk++) {
+         float val;
+         if (esize == sizeof(unsigned char)) val = (float)plane[jk] / 255.f;
+         else if (esize == sizeof(unsigned short)) val = (float)((unsigned short*)plane)[jk] / 65535.f;
+         else val = ((float*)plane)[jk];
+         if (dat) dat[i][0][jk] = (unsigned char)(255.f*fminf(fmaxf(val, 0.f), 1.f) + 0.5f);
+         else fdat[i][0][jk] = val;
+      }
+   }
+   free(plane);
+   fclose(ifp);
+
+   return finish_bob(dat, fdat, nx, ny, nz, start, dx, diffuseSteps, repose, erode, outType, contour);
+}
+
+/*
+ * Stream the brick out one x-plane at a time
+ *
+ * The voxelizer and the -diffuse and -erode passes only look a few x-planes
+ * ahead, so without -repose (which carries overhangs across the whole
+ * brick) nothing needs the dense brick: triangles are sorted by their
+ * first x-plane, each chunk of planes is voxelized (one plane per thread)
+ * by the triangles that overlap it, and the planes then run through the
+ * filter passes in x order and out to stdout. Each diffusion step and
+ * each erosion pass keeps its last 3 planes and works one plane behind the
+ * pass before it, so memory is O(ny*nz*(chunk + 3*passes)), not
+ * O(nx*ny*nz), and the output is the same as from the dense brick
+ */
+
+// planes voxelized together, per thread
+#define STREAM_PLANES 2
+
+// a triangle's voxel range, and where it is in the triangle list
+typedef struct stream_tri_record {
+   int it;
+   int imin, imax, jmin, jmax, kmin, kmax;
+} STREAM_TRI;
+
+static int compare_stream_tri (const void* a, const void* b) {
+   const STREAM_TRI* ta = (const STREAM_TRI*)a;
+   const STREAM_TRI* tb = (const STREAM_TRI*)b;
+   if (ta->imin != tb->imin) return (ta->imin < tb->imin) ? -1 : 1;
+   return (ta->it > tb->it) - (ta->it < tb->it);
+}
+
+// the shell ramp, for a voxel thisDist voxels outside the shell:
+//    255 (1.0) inside, 127 (0.5) right on the boundary, and 0 (0.0) more
+//    than 1 voxel away from it
+static inline unsigned char shell_byte (const double thisDist) {
+   if (thisDist < -1.0) return 255;
+   if (thisDist < 1.0) return 255 - (unsigned char)(255.0*0.5*(1.0 + thisDist));
+   return 0;
+}
+
+static inline float shell_float (const double thisDist) {
+   if (thisDist < -1.0) return 1.f;
+   if (thisDist < 1.0) return 1.f - 0.5f*(1.f + (float)thisDist);
+   return 0.f;
+}
+
+// number of planes stream_bob keeps in memory
+static int stream_window (const int diffuseSteps, const double erode) {
+   int num_threads = 1;
+#ifdef _OPENMP
+   num_threads = omp_get_max_threads();
+#endif
+   const int num_erode = (erode > 0.0) ? (int)(erode+0.999999) : 0;
+   return STREAM_PLANES*num_threads + 2 + 3*(diffuseSteps + num_erode);
+}
+
+// plane p after "level" passes; level 0 is the voxelized plane
+static inline unsigned char* stream_plane (unsigned char* raw, const int raw_cap,
+      unsigned char* lev, const size_t plane_bytes, const int level, const int p) {
+   if (level == 0) return raw + (size_t)(p % raw_cap)*plane_bytes;
+   return lev + ((size_t)(level-1)*3 + p%3)*plane_bytes;
+}
+
+static int stream_bob (tri_pointer tri_head, const double* start, const double dx,
+      const double rad, const int nx, const int ny, const int nz,
+      const int diffuseSteps, const double erode, const OUT_FORMAT outType) {
+
+   const int esize = (outType == bob) ? sizeof(unsigned char) : sizeof(float);
+   const size_t np = (size_t)ny*nz;
+   const size_t plane_bytes = np*esize;
+   const size_t rowb = (size_t)nz*esize;
+
+   int num_threads = 1;
+#ifdef _OPENMP
+   num_threads = omp_get_max_threads();
+#endif
+   const int chunk = STREAM_PLANES*num_threads;
+
+   // the passes after voxelizing: diffusion steps, then erosion passes
+   const int num_erode = (erode > 0.0) ? (int)(erode+0.999999) : 0;
+   const int num_levels = diffuseSteps + num_erode;
+   int* eoff = (int*)malloc((num_erode+1)*78*sizeof(int));
+   double* ewgt = (double*)malloc((num_erode+1)*26*sizeof(double));
+   int* ennb = (int*)malloc((num_erode+1)*sizeof(int));
+   for (int iter=0; iter<num_erode; ++iter) {
+      double er = erode - (double)iter;
+      if (er > 1.0) er = 1.0;
+      ennb[iter] = erode_stencil(er, eoff+78*iter, ewgt+26*iter);
+   }
+
+   // the window: voxelized planes from 2 before the chunk to its end,
+   //    and the last 3 planes of every pass
+   const int raw_cap = chunk + 2;
+   unsigned char* raw = (unsigned char*)malloc((size_t)raw_cap*plane_bytes);
+   unsigned char* lev = (unsigned char*)malloc((size_t)(3*num_levels+1)*plane_bytes);
+   unsigned short* splane = (outType == bos) ? (unsigned short*)malloc(np*sizeof(unsigned short)) : NULL;
+   if (!raw || !lev) {
+      fprintf(stderr,"Could not allocate %d planes, quitting.\n", raw_cap + 3*num_levels);
+      return(1);
+   }
+   fprintf(stderr,"  streaming through %d planes, %g MB (dense brick is %g MB)\n",
+           raw_cap + 3*num_levels, (double)(raw_cap + 3*num_levels)*plane_bytes/1.e+6,
+           (double)nx*plane_bytes/1.e+6);
+
+   // find every triangle's voxel range, and sort them by first x-plane
+   int num_tris = 0;
+   for (tri_pointer this_tri = tri_head; this_tri; this_tri = this_tri->next_tri) num_tris++;
+   tri_pointer* tri_list = (tri_pointer*)malloc(num_tris*sizeof(tri_pointer));
+   STREAM_TRI* order = (STREAM_TRI*)malloc(num_tris*sizeof(STREAM_TRI));
+   int num_order = 0;
+   int cnt = 0;
+   for (tri_pointer this_tri = tri_head; this_tri; this_tri = this_tri->next_tri) {
+      double x[3], y[3], z[3];
+      for (int c=0; c<3; c++) {
+         x[c] = (this_tri->node[c]->loc.x - start[0]) / dx;
+         y[c] = (this_tri->node[c]->loc.y - start[1]) / dx;
+         z[c] = (this_tri->node[c]->loc.z - start[2]) / dx;
+      }
+      STREAM_TRI st;
+      st.it = cnt;
+      st.imin = max((int)floor(fmin(x[0]-rad, fmin(x[1]-rad, x[2]-rad))) - 1, 0);
+      st.imax = min((int)ceil(fmax(x[0]+rad, fmax(x[1]+rad, x[2]+rad))) + 1, nx);
+      st.jmin = max((int)floor(fmin(y[0]-rad, fmin(y[1]-rad, y[2]-rad))) - 1, 0);
+      st.jmax = min((int)ceil(fmax(y[0]+rad, fmax(y[1]+rad, y[2]+rad))) + 1, ny);
+      st.kmin = max((int)floor(fmin(z[0]-rad, fmin(z[1]-rad, z[2]-rad))) - 1, 0);
+      st.kmax = min((int)ceil(fmax(z[0]+rad, fmax(z[1]+rad, z[2]+rad))) + 1, nz);
+      if (st.imax > st.imin && st.jmax > st.jmin && st.kmax > st.kmin) order[num_order++] = st;
+      tri_list[cnt++] = this_tri;
+   }
+   qsort(order, num_order, sizeof(STREAM_TRI), compare_stream_tri);
+
+   // the triangles overlapping the current chunk, prepared for distances
+   int act_cap = 1024;
+   int num_act = 0;
+   STREAM_TRI* act = (STREAM_TRI*)malloc(act_cap*sizeof(STREAM_TRI));
+   TRI_DIST* act_td = (TRI_DIST*)malloc(act_cap*sizeof(TRI_DIST));
+   int next = 0;
+
+   // write header
+   fwrite(&nx,sizeof(int),1,stdout);
+   fwrite(&ny,sizeof(int),1,stdout);
+   fwrite(&nz,sizeof(int),1,stdout);
+
+   fprintf(stderr,"Writing data to voxels"); fflush(stderr);
+   const double tstart = wall_time();
+   const int dot_every = max(1, nx/(8*num_threads));
+   double num_tests = 0.0;
+
+   // plane s is voxelized at sweep position s, pass l finishes plane s-l,
+   //    and the last pass's plane is written right away
+   for (int c0=0; c0<nx+num_levels; c0+=chunk) {
+      const int c1 = min(c0+chunk, nx);
+
+      // retire the triangles behind the chunk, and bring in the new ones
+      int num_old = 0;
+      for (int a=0; a<num_act; a++) {
+         if (act[a].imax > c0) {
+            act[num_old] = act[a];
+            act_td[num_old] = act_td[a];
+            num_old++;
+         }
+      }
+      num_act = num_old;
+      for ( ; next<num_order && order[next].imin < c1; next++) {
+         if (num_act == act_cap) {
+            act_cap *= 2;
+            act = (STREAM_TRI*)realloc(act, act_cap*sizeof(STREAM_TRI));
+            act_td = (TRI_DIST*)realloc(act_td, act_cap*sizeof(TRI_DIST));
+         }
+         act[num_act++] = order[next];
+      }
+
+      #pragma omp parallel reduction(+:num_tests)
+      {
+      #pragma omp for schedule(static)
+      for (int a=num_old; a<num_act; a++) {
+         const tri_pointer tri = tri_list[act[a].it];
+         double v[3][3];
+         for (int c=0; c<3; c++) {
+            v[c][0] = (tri->node[c]->loc.x - start[0]) / dx;
+            v[c][1] = (tri->node[c]->loc.y - start[1]) / dx;
+            v[c][2] = (tri->node[c]->loc.z - start[2]) / dx;
+         }
+         prep_tri_dist(&act_td[a], v[0][0],v[0][1],v[0][2], v[1][0],v[1][1],v[1][2],
+                       v[2][0],v[2][1],v[2][2]);
+      }
+
+      // voxelize the chunk, one plane per thread; max() does not care
+      //    about the order of the triangles
+      double* kdist = (double*)malloc((nz+1)*sizeof(double));
+      #pragma omp for schedule(dynamic,1)
+      for (int i=c0; i<c1; i++) {
+         unsigned char* plane = stream_plane(raw, raw_cap, lev, plane_bytes, 0, i);
+         memset(plane, 0, plane_bytes);
+         for (int a=0; a<num_act; a++) {
+            const STREAM_TRI* st = &act[a];
+            if (i < st->imin || i >= st->imax) continue;
+            num_tests += (double)(st->jmax-st->jmin) * (double)(st->kmax-st->kmin);
+            for (int j=st->jmin; j<st->jmax; j++) {
+               mdtri_row(&act_td[a], (double)i+0.5, (double)j+0.5, (double)st->kmin+0.5,
+                         st->kmax-st->kmin, kdist);
+               if (esize == 1) {
+                  unsigned char* row = plane + (size_t)j*rowb;
+                  for (int k=st->kmin; k<st->kmax; k++) {
+                     const unsigned char thisChar = shell_byte(sqrt(kdist[k-st->kmin]) - rad);
+                     if (thisChar > row[k]) row[k] = thisChar;
+                  }
+               } else {
+                  float* row = (float*)(plane + (size_t)j*rowb);
+                  for (int k=st->kmin; k<st->kmax; k++) {
+                     const float thisVal = shell_float(sqrt(kdist[k-st->kmin]) - rad);
+                     if (thisVal > row[k]) row[k] = thisVal;
+                  }
+               }
+            }
+         }
+      }
+      free(kdist);
+
+      // run every pass one plane further, and write the finished plane
+      for (int s=c0; s<min(c0+chunk, nx+num_levels); s++) {
+         for (int l=1; l<=num_levels; l++) {
+            const int p = s - l;
+            if (p < 0 || p >= nx) continue;
+            unsigned char* out = stream_plane(raw, raw_cap, lev, plane_bytes, l, p);
+            const unsigned char* c = stream_plane(raw, raw_cap, lev, plane_bytes, l-1, p);
+
+            // edge planes, rows, and columns do not change
+            if (p == 0 || p == nx-1) {
+               #pragma omp single
+               memcpy(out, c, plane_bytes);
+               continue;
+            }
+
+            if (l <= diffuseSteps) {
+               // Gauss-Seidel in x: the -x plane is from this step
+               const unsigned char* xm = stream_plane(raw, raw_cap, lev, plane_bytes, l, p-1);
+               const unsigned char* xp = stream_plane(raw, raw_cap, lev, plane_bytes, l-1, p+1);
+               #pragma omp for schedule(static)
+               for (int y=0; y<ny; y++) {
+                  const size_t o = (size_t)y*rowb;
+                  if (y == 0 || y == ny-1) memcpy(out+o, c+o, rowb);
+                  else if (esize == 1) diffuse_row_b(out+o, xm+o, c+o, c+o-rowb, c+o+rowb, xp+o, nz);
+                  else diffuse_row_f((float*)(out+o), (const float*)(xm+o), (const float*)(c+o),
+                                     (const float*)(c+o-rowb), (const float*)(c+o+rowb),
+                                     (const float*)(xp+o), nz);
+               }
+            } else {
+               // erosion only reads the pass before it
+               const int e = l - diffuseSteps - 1;
+               const unsigned char* pl[3] = {stream_plane(raw, raw_cap, lev, plane_bytes, l-1, p-1), c,
+                                             stream_plane(raw, raw_cap, lev, plane_bytes, l-1, p+1)};
+               const float* fpl[3] = {(const float*)pl[0], (const float*)pl[1], (const float*)pl[2]};
+               #pragma omp for schedule(static)
+               for (int y=0; y<ny; y++) {
+                  const size_t o = (size_t)y*rowb;
+                  memcpy(out+o, c+o, rowb);
+                  if (y == 0 || y == ny-1) continue;
+                  if (esize == 1) erode_row_b(out+o, pl, y, nz, ennb[e], eoff+78*e, ewgt+26*e);
+                  else erode_row_f((float*)(out+o), fpl, y, nz,
+                                   ennb[e], eoff+78*e, ewgt+26*e);
+               }
+            }
+         }
+
+         #pragma omp single
+         {
+         const int p = s - num_levels;
+         if (p >= 0 && p < nx) {
+            const unsigned char* src = stream_plane(raw, raw_cap, lev, plane_bytes, num_levels, p);
+            if (outType == bos) {
+               shorts_from_floats((const float*)src, splane, np);
+               fwrite(splane,sizeof(unsigned short),np,stdout);
+            } else {
+               fwrite(src,esize,np,stdout);
+            }
+            if (p%dot_every == 0) {
+               fprintf(stderr,".");
+               fflush(stderr);
+            }
+         }
+         }
+      }
+      }
+   }
+   fprintf(stderr,"\n");
+   const double tvox = wall_time() - tstart;
+   fprintf(stderr,"  %d tris, %g voxel tests, %d passes in %g s on %d threads\n",
+           num_tris, num_tests, num_levels, tvox, num_threads);
+   fflush(stderr);
+
+   free(act);
+   free(act_td);
+   free(order);
+   free(tri_list);
+   free(raw);
+   free(lev);
+   free(splane);
+   free(eoff);
+   free(ewgt);
+   free(ennb);
+   return(0);
+}
+
 /*
  * Write a voxel of the shell of a mesh
  *
  * "dx" is the voxel size
  * "thick" is the thickness of the mesh, in world units
+ * "do_sdf" writes the signed distance to the mesh instead, as floats
+ * "contour" gets the contoured brick, if output_format is a mesh format
  */
 int write_bob (tri_pointer tri_head, double *xb, double *yb, double *zb,
       double dx, double thick, int diffuseSteps, double repose, double erode,
-      char* output_format) {
+      int do_sdf, char* output_format, tri_pointer* contour) {
 
    int nx, ny, nz;
    double start[3];
    double size[3];
    unsigned char*** dat = NULL;
+   float*** fdat = NULL;
+   float*** sdf = NULL;
 
    double xmin,xmax,ymin,ymax;		// bounds of the image
    double zmin,zmax;			// bounds in the image direction
@@ -363,18 +2091,19 @@ int write_bob (tri_pointer tri_head, double *xb, double *yb, double *zb,
      debug_out = fopen("temp", "w");
 
    // set the desired output format
-   if (strncmp(output_format, "bob", 3) == 0) {
-      outType = bob;
-   } else if (strncmp(output_format, "bos", 3) == 0) {
-      outType = bos;
-   } else if (strncmp(output_format, "bof", 3) == 0) {
+   outType = bob_format(output_format);
+   if (do_sdf && outType == mesh) {
+      fprintf(stderr,"WARNING (write_bob): -sdf is ignored for mesh output.\n");
+      do_sdf = FALSE;
+   }
+   if (do_sdf && outType != bof) {
+      fprintf(stderr,"WARNING (write_bob): distance fields are floats, writing bof.\n");
       outType = bof;
-   } else {
-      fprintf(stderr,"WARNING (write_bob): output file format (%s)\n",output_format);
-      fprintf(stderr,"  unrecognized. Writing bob by default.\n");
-      outType = bob;
    }
 
+   // bob is built and filtered in bytes, everything else in floats (0..1)
+   const int use_float = (outType != bob);
+
    // now, actually create the data //
 
    // cycle through all elements, determining the aspect ratio needed
@@ -473,10 +2202,6 @@ int write_bob (tri_pointer tri_head, double *xb, double *yb, double *zb,
            start[1],start[1]+size[1],
            start[2],start[2]+size[2]);
 
-   if ((size_t)nx * (size_t)ny * (size_t)nz > 10000000000) {
-      fprintf(stderr,"Grid seems too large (%d %d %d), quitting!\n", nx, ny, nz);
-      exit(0);
-   }
    if (nx < 0 || ny < 0 || nz < 0) {
       fprintf(stderr,"Grid seems incorrect (%d %d %d), quitting!\n", nx, ny, nz);
       exit(0);
@@ -484,32 +2209,120 @@ int write_bob (tri_pointer tri_head, double *xb, double *yb, double *zb,
 
    fprintf(stderr,"  brick will be %d x %d x %d\n",nx,ny,nz);
 
+   // the signed distance field does not go through the byte filters
+   if (do_sdf && (diffuseSteps > 0 || (repose > 0.0 && repose < 90.1) || erode != 0.0)) {
+      fprintf(stderr,"  -diffuse, -repose, and -erode are ignored for distance fields\n");
+      diffuseSteps = 0;
+      repose = -45.0;
+      erode = 0.0;
+   }
+
+   // only -repose, contouring, and the distance field need the whole
+   //    brick in memory; everything else streams through a window of x-planes
+   const int need_dense = (repose > 0.0 && repose < 90.1) || outType == mesh;
+   const int streaming = !need_dense && !do_sdf;
+
    // sanity check on bob size
-   if (nx*(float)ny*nz > 1.0e+11 || nx > 100000 || ny > 100000 || nz > 100000) {
-      fprintf(stderr,"Will not write brick-of-bytes file that large.\n");
+   const size_t num_cells = (size_t)nx * (size_t)ny * (size_t)nz;
+   const size_t voxel_bytes = use_float ? sizeof(float) : sizeof(unsigned char);
+   const size_t held_cells = streaming ? (size_t)ny*nz*stream_window(diffuseSteps, erode) : num_cells;
+   if (nx > 100000 || ny > 100000 || nz > 100000 || held_cells*voxel_bytes > 10000000000) {
+      fprintf(stderr,"Will not write brick file that large.\n");
       fflush(stderr);
       return(1);
    }
 
-   // allocate the array(s)
-   dat = allocate_3d_array_b (nx, ny, nz);
+   if (streaming) {
+      if (debug_write)
+        fclose(debug_out);
+      return stream_bob(tri_head, start, dx, thick/dx, nx, ny, nz, diffuseSteps, erode, outType);
+   }
 
-   // zero out the array
-   for (int i=0; i<nx; i++) for (int j=0; j<ny; j++) for (int k=0; k<nz; k++) dat[i][j][k] = 0.0;
+   // allocate the dense brick that -repose or contouring needs, all
+   //    zeros until written, or the distance field, all far away
+   if (do_sdf) {
+      sdf = allocate_3d_array_f (nx, ny, nz);
+      #pragma omp parallel for
+      for (int i=0; i<nx; i++)
+         for (size_t jk=0; jk<(size_t)ny*nz; jk++) sdf[i][0][jk] = SDF_FAR;
+   } else {
+      if (use_float) fdat = allocate_3d_array_f (nx, ny, nz);
+      else dat = allocate_3d_array_b (nx, ny, nz);
+      #pragma omp parallel for
+      for (int i=0; i<nx; i++) {
+         if (fdat) memset(&fdat[i][0][0], 0, (size_t)ny*nz*sizeof(float));
+         else memset(&dat[i][0][0], 0, (size_t)ny*nz);
+      }
+   }
 
 
    // then, loop through all elements, writing to the image
    fprintf(stderr,"Writing data to voxels"); fflush(stderr);
-
+   const double rad = do_sdf ? SDF_BAND : thick/dx;
+   const double tstart = wall_time();
+
+   // split the brick into slabs of x-planes, one thread per slab at a
+   //    time, so that no two threads ever write the same voxel
+   int num_threads = 1;
+#ifdef _OPENMP
+   num_threads = omp_get_max_threads();
+#endif
+   int num_slabs = 8*num_threads;
+   if (num_slabs > nx) num_slabs = nx;
+   int slab_start[num_slabs+1];
+   for (int is=0; is<=num_slabs; is++) slab_start[is] = (int)(((long)is*nx)/num_slabs);
+
+   // list the triangles touching each slab (compressed rows: the tris of
+   //    slab is are slab_tris[slab_ptr[is]] to slab_tris[slab_ptr[is+1]-1])
+   int num_tris = 0;
+   for (this_tri = tri_head; this_tri; this_tri = this_tri->next_tri) num_tris++;
+   tri_pointer* tri_list = (tri_pointer*)malloc(num_tris*sizeof(tri_pointer));
+   int* tri_imin = (int*)malloc(2*num_tris*sizeof(int));
+   int* tri_imax = tri_imin + num_tris;
+   size_t* slab_ptr = (size_t*)calloc(num_slabs+1, sizeof(size_t));
    cnt = 0;
-   this_tri = tri_head;
-   while (this_tri) {
-
-      const node_ptr n0 = this_tri->node[0];
-      const node_ptr n1 = this_tri->node[1];
-      const node_ptr n2 = this_tri->node[2];
-
-      const double rad = thick/dx;
+   for (this_tri = tri_head; this_tri; this_tri = this_tri->next_tri) {
+      const double x1 = (this_tri->node[0]->loc.x - start[0]) / dx;
+      const double x2 = (this_tri->node[1]->loc.x - start[0]) / dx;
+      const double x3 = (this_tri->node[2]->loc.x - start[0]) / dx;
+      tri_list[cnt] = this_tri;
+      tri_imin[cnt] = max((int)floor(fmin(x1-rad, fmin(x2-rad, x3-rad))) - 1, 0);
+      tri_imax[cnt] = min((int)ceil(fmax(x1+rad, fmax(x2+rad, x3+rad))) + 1, nx);
+      if (tri_imax[cnt] > tri_imin[cnt]) {
+         const int is_hi = slab_of(tri_imax[cnt]-1, slab_start, num_slabs, nx);
+         for (int is=slab_of(tri_imin[cnt], slab_start, num_slabs, nx); is<=is_hi; is++) slab_ptr[is+1]++;
+      }
+      cnt++;
+   }
+   for (int is=0; is<num_slabs; is++) slab_ptr[is+1] += slab_ptr[is];
+   int* slab_tris = (int*)malloc(slab_ptr[num_slabs]*sizeof(int));
+   size_t* slab_fill = (size_t*)malloc(num_slabs*sizeof(size_t));
+   for (int is=0; is<num_slabs; is++) slab_fill[is] = slab_ptr[is];
+   for (int it=0; it<num_tris; it++) {
+      if (tri_imax[it] > tri_imin[it]) {
+         const int is_hi = slab_of(tri_imax[it]-1, slab_start, num_slabs, nx);
+         for (int is=slab_of(tri_imin[it], slab_start, num_slabs, nx); is<=is_hi; is++) slab_tris[slab_fill[is]++] = it;
+      }
+   }
+   free(slab_fill);
+
+   // voxelize, slab by slab; triangles keep their input order within a
+   //    slab, and max() does not care about order anyway
+   double num_tests = 0.0;
+   #pragma omp parallel reduction(+:num_tests)
+   {
+   // per-thread distances along one k-run
+   double* kdist = (double*)malloc((nz+1)*sizeof(double));
+
+   #pragma omp for schedule(dynamic,1)
+   for (int is=0; is<num_slabs; is++) {
+   for (size_t ip=slab_ptr[is]; ip<slab_ptr[is+1]; ip++) {
+      const int it = slab_tris[ip];
+      const tri_pointer tri = tri_list[it];
+
+      const node_ptr n0 = tri->node[0];
+      const node_ptr n1 = tri->node[1];
+      const node_ptr n2 = tri->node[2];
 
       // scale the tri into grid coords
       const double x1 = (n0->loc.x - start[0]) / dx;
@@ -522,242 +2335,90 @@ int write_bob (tri_pointer tri_head, double *xb, double *yb, double *zb,
       const double y3 = (n2->loc.y - start[1]) / dx;
       const double z3 = (n2->loc.z - start[2]) / dx;
 
-      // find x,y,z range affected by this segment
-      const int imin = max((int)floor(fmin(x1-rad, fmin(x2-rad, x3-rad))) - 1, 0);
-      const int imax = min((int)ceil(fmax(x1+rad, fmax(x2+rad, x3+rad))) + 1, nx);
+      // find x,y,z range affected by this segment, x only within this slab
+      const int imin = max(tri_imin[it], slab_start[is]);
+      const int imax = min(tri_imax[it], slab_start[is+1]);
       const int jmin = max((int)floor(fmin(y1-rad, fmin(y2-rad, y3-rad))) - 1, 0);
       const int jmax = min((int)ceil(fmax(y1+rad, fmax(y2+rad, y3+rad))) + 1, ny);
       const int kmin = max((int)floor(fmin(z1-rad, fmin(z2-rad, z3-rad))) - 1, 0);
       const int kmax = min((int)ceil(fmax(z1+rad, fmax(z2+rad, z3+rad))) + 1, nz);
+      if (imax > imin && jmax > jmin && kmax > kmin)
+         num_tests += (double)(imax-imin) * (double)(jmax-jmin) * (double)(kmax-kmin);
+
+      TRI_DIST td;
+      prep_tri_dist(&td, x1,y1,z1, x2,y2,z2, x3,y3,z3);
 
       // loop over that subblock
       for (int i=imin; i<imax; i++) {
       for (int j=jmin; j<jmax; j++) {
+      // find squared distances from triangle to node centers, in cell
+      //    units, for the whole run in k at once
+      //thisDist = mdtri(x1,y1,z1, x2,y2,z2, x3,y3,z3, (double)i+0.5, (double)j+0.5, (double)k+0.5);
+      if (kmax > kmin) mdtri_row(&td, (double)i+0.5, (double)j+0.5, (double)kmin+0.5, kmax-kmin, kdist);
       for (int k=kmin; k<kmax; k++) {
          // how far is this node from the segment, in voxels?
-         double thisDist = 2.0;
+         double thisDist = sqrt(kdist[k-kmin]);
 
-         // find distance from triangle to node center, in cell units
-         //thisDist = minimum_distance(x1,y1,z1, x2,y2,z2, (double)i+0.5,(double)j+0.5,(double)k+0.5) - rad;
-         thisDist = mdtri(x1,y1,z1, x2,y2,z2, x3,y3,z3, (double)i+0.5, (double)j+0.5, (double)k+0.5);
+         // the distance field keeps the nearest, unsigned for now
+         if (sdf) {
+            if (thisDist < sdf[i][j][k]) sdf[i][j][k] = (float)thisDist;
+            continue;
+         }
          thisDist -= rad;
 
+         // floats keep the same ramp, from 1=inside to 0=away, unrounded
+         if (fdat) {
+            const float thisVal = shell_float(thisDist);
+            if (thisVal > fdat[i][j][k]) fdat[i][j][k] = thisVal;
+            continue;
+         }
+
          // convert that distance to an unsigned char
-         // 255=inside
-         // 127=right on the boundary
-         // 0=more than 1 voxel away from surface
-         unsigned char thisChar = 0;
-         if (thisDist < -1.0) thisChar = 255;
-         else if (thisDist < 1.0) thisChar = 255 - (unsigned char)(255.0*0.5*(1.0 + thisDist));
+         const unsigned char thisChar = shell_byte(thisDist);
 
          // only update the array if this voxel is nearer to this segment
          if (thisChar > dat[i][j][k]) dat[i][j][k] = thisChar;
       }
       }
       }
-
-      // advance
-      this_tri = this_tri->next_tri;
- 
-      if (++cnt%DOTPER == 1) {
-         fprintf(stderr,".");
-         fflush(stderr);
-      }
+   }
+      fprintf(stderr,".");
+      fflush(stderr);
+   }
+   free(kdist);
    }
    fprintf(stderr,"\n");
+   const double tvox = wall_time() - tstart;
+   fprintf(stderr,"  %d tris, %g voxel tests in %g s on %d threads, %g voxels/s\n",
+           num_tris, num_tests, tvox, num_threads, num_tests/fmax(tvox,1.e-9));
    fflush(stderr);
 
-   if (debug_write)
-     fclose(debug_out);
-
-
-   // optionally diffuse the brick-of-whatevers
-   // smooth the bof in-place (eventually put this in bobtools)
-   if (diffuseSteps > 0) {
-
-      // allocate temporary bof array - but only one plane!
-      unsigned char** temp1 = allocate_2d_array_b(ny,nz);
-      unsigned char** temp2 = allocate_2d_array_b(ny,nz);
-
-      fprintf(stderr,"diffusing");
-      fflush(stderr);
-      for (int iter=0; iter<diffuseSteps; iter++) {
-         fprintf(stderr,".");
-         fflush(stderr);
-
-         // copy first plane into temp1
-         for (int j=0; j<ny; j++)
-            for (int k=0; k<nz; k++)
-               temp1[j][k] = dat[0][j][k];
-
-         // iterate through planes
-         for (int ix=1; ix<nx-1; ix++) {
-
-            // do the diffusion, put it in temp2
-            for (int iy=1; iy<ny-1; iy++) {
-            for (int iz=1; iz<nz-1; iz++) {
-               unsigned int neibsum = (unsigned int)dat[ix][iy][iz+1]
-                                     +(unsigned int)dat[ix][iy][iz-1]
-                                     +(unsigned int)dat[ix][iy+1][iz]
-                                     +(unsigned int)dat[ix][iy-1][iz]
-                                     +(unsigned int)dat[ix+1][iy][iz]
-                                     +(unsigned int)temp1[iy][iz];
-               temp2[iy][iz] = (unsigned char)((neibsum + 6*(unsigned int)dat[ix][iy][iz] + 6) / 12);
-            }
-            }
-
-            // we can overwrite plane ix-1 now
-            for (int j=0; j<ny; j++)
-               for (int k=0; k<nz; k++)
-                  dat[ix-1][j][k] = temp1[j][k];
-
-            // and swap planes
-            for (int j=0; j<ny; j++)
-               for (int k=0; k<nz; k++)
-                  temp1[j][k] = temp2[j][k];
-         }
-
-         // copy temp1 into last plane
-         for (int j=0; j<ny; j++)
-            for (int k=0; k<nz; k++)
-               dat[nx-2][j][k] = temp1[j][k];
-      }
+   // the distance field is finished separately, and written here
+   if (sdf) {
+      (void) finish_sdf(sdf, nx, ny, nz, dx, start, tri_list, num_tris,
+                        slab_start, num_slabs, slab_ptr, slab_tris, tri_imin, tri_imax);
 
-      free_2d_array_b(temp1);
-      free_2d_array_b(temp2);
+      fprintf(stderr,"Writing BOF file"); fflush(stderr);
+      (void) write_bob_file_from_float(stdout, sdf, nx, ny, nz, FALSE);
       fprintf(stderr,"\n");
       fflush(stderr);
-   }
 
-
-   // then, expand to allow 3D printing
-   if (repose > 0.0 && repose < 90.1) {
-      fprintf(stderr,"Growing base to avoid overhangs\n"); fflush(stderr);
-
-      // depending on the angle (this should work for anything steeper than 45 degrees (45-90)
-      const float angle = (float)repose;
-
-      // compute adjacent and diagonal weights
-      const float tana = tan((90.0-angle)*M_PI/180.0);
-      const float aw1 = tana;
-      const float aw2 = 1.0-tana;
-      const float tast = tana/sqrt(2.0);
-      const float dw1 = tast*tast;
-      const float dw2 = tast*(1.0-tast);
-      const float dw3 = (1.0-tast)*(1.0-tast);
-
-      // iterate through z-planes, from top to bottom
-      for (int iz=nz-2; iz>0; --iz) {
-
-         // for this layer, look up (+z) for data
-         for (int ix=1; ix<nx-1; ++ix) {
-         for (int iy=1; iy<ny-1; ++iy) {
-            // enforce 45 degree angle (255 = inside object)
-            // linearly interpolate to find diagonal values (as they are farther than 1 dx away)
-            const int ne = (int)(dw1*(float)dat[ix+1][iy+1][iz+1] + dw3*(float)dat[ix][iy][iz+1] +
-                                 dw2*(float)dat[ix+1][iy][iz+1] + dw2*(float)dat[ix][iy+1][iz+1]);
-            const int nw = (int)(dw1*(float)dat[ix-1][iy+1][iz+1] + dw3*(float)dat[ix][iy][iz+1] +
-                                 dw2*(float)dat[ix-1][iy][iz+1] + dw2*(float)dat[ix][iy+1][iz+1]);
-            const int sw = (int)(dw1*(float)dat[ix-1][iy-1][iz+1] + dw3*(float)dat[ix][iy][iz+1] +
-                                 dw2*(float)dat[ix-1][iy][iz+1] + dw2*(float)dat[ix][iy-1][iz+1]);
-            const int se = (int)(dw1*(float)dat[ix+1][iy-1][iz+1] + dw3*(float)dat[ix][iy][iz+1] +
-                                 dw2*(float)dat[ix+1][iy][iz+1] + dw2*(float)dat[ix][iy-1][iz+1]);
-            // the adjacent columns are easier
-            const int nn = (int)(aw1*(float)dat[ix][iy+1][iz+1] + aw2*(float)dat[ix][iy][iz+1]);
-            const int ee = (int)(aw1*(float)dat[ix+1][iy][iz+1] + aw2*(float)dat[ix][iy][iz+1]);
-            const int ww = (int)(aw1*(float)dat[ix-1][iy][iz+1] + aw2*(float)dat[ix][iy][iz+1]);
-            const int ss = (int)(aw1*(float)dat[ix][iy-1][iz+1] + aw2*(float)dat[ix][iy][iz+1]);
-            const int xneib = min(ee, ww);
-            const int yneib = min(nn, ss);
-            const int aneib = min(sw, ne);
-            const int bneib = min(se, nw);
-            const int hneib = min(xneib, yneib);
-            const int dneib = min(aneib, bneib);
-            const int allnb = min(hneib, dneib);
-            const int currv = (int)dat[ix][iy][iz];
-            dat[ix][iy][iz] = (unsigned char)max(currv, allnb);
-         }
-         }
-      }
+      free(tri_list);
+      free(tri_imin);
+      free(slab_ptr);
+      free(slab_tris);
+      free_3d_array_f(sdf, nx);
+      return(0);
    }
 
-   // grow or shrink uniformly, also called dilate/erode
-   if (erode > 0.0) {
-      fprintf(stderr,"Eroding voxels\n"); fflush(stderr);
+   free(tri_list);
+   free(tri_imin);
+   free(slab_ptr);
+   free(slab_tris);
 
-      // first, allocate a copy of the 3d voxel array
-      unsigned char*** temp = allocate_3d_array_b (nx, ny, nz);
-
-      // zero out the array
-      //for (int i=0; i<nx; i++) for (int j=0; j<ny; j++) for (int k=0; k<nz; k++) temp[i][j][k] = 0;
-
-      // and only erode one voxel at a time
-      for (int iter=0; iter<(int)(erode+0.999999); ++iter) {
-
-         double er = erode - (double)iter;
-         if (er > 1.0) er = 1.0;
-         fprintf(stderr,"  eroding %g\n", er); fflush(stderr);
-
-         // copy the other array in first
-         for (int i=0; i<nx; i++)
-         for (int j=0; j<ny; j++)
-         for (int k=0; k<nz; k++)
-            temp[i][j][k] = dat[i][j][k];
-
-         // then march through the middle, filling the new one with an eroded version
-         #pragma omp parallel
-         for (int ix=1; ix<nx-1; ++ix) {
-         for (int iy=1; iy<ny-1; ++iy) {
-         for (int iz=1; iz<nz-1; ++iz) {
-            // search 27 neighbors from the other array
-            for (int i=-1; i<2; ++i) {
-            for (int j=-1; j<2; ++j) {
-            for (int k=-1; k<2; ++k) {
-               // simple - test vs value, regardless of distance
-               //temp[ix][iy][iz] = min(temp[ix][iy][iz], dat[ix+i][iy+j][iz+k]);
-               // sophisticated - test vs value on interpolated line
-               const double dist = sqrt((double)(i*i+j*j+k*k));
-               if (dist > 0.1) {
-                  const double wgt = er/dist;
-                  const unsigned char testval = wgt*dat[ix+i][iy+j][iz+k]
-                                              + (1.0-wgt)*temp[ix][iy][iz];
-                  temp[ix][iy][iz] = min(temp[ix][iy][iz], testval);
-               }
-            }
-            }
-            }
-         }
-         }
-         }
-
-         // swap pointers to the two arrays
-         unsigned char*** swap = dat;
-         dat = temp;
-         temp = swap;
-      }
-
-      // return the finished array and delete the other
-      free_3d_array_b(temp, nx, ny, nz);
-   }
-
-   // finally, print the image
-   if (outType == bob) {
-      fprintf(stderr,"Writing BOB file"); fflush(stderr);
-
-      // finally, write the file
-      FILE *ofp = stdout;
-      (void) write_bob_file_from_uchar(ofp, dat, nx, ny, nz);
-
-      // free the memory and return
-      free_3d_array_b(dat, nx, ny, nz);
-
-      fprintf(stderr,"\n");
-      fflush(stderr);
-   } else {
-      fprintf(stderr,"Output file format unsupported.\n"); fflush(stderr);
-   }
+   if (debug_write)
+     fclose(debug_out);
 
-   // replace the old list with the new list
-   return(0);
+   return finish_bob(dat, fdat, nx, ny, nz, start, dx, diffuseSteps, repose, erode, outType, contour);
 }
 
@@ -28,27 +28,141 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <math.h>
+#include <float.h>
 #include "structs.h"
 
+// gravity points down z unless a center is set, in which case it
+// points toward the center and elevation is distance from it
+static int radial_gravity = FALSE;
+static VEC gravity_center;
+
+// all nodes in list order, with node->index set to their place in it;
+// rebuilt on every call, since the writers renumber node->index
+static node_ptr *flow_nodes = NULL;
+static int max_flow_nodes = 0;
+
+// elevation of each node, set along with flow_nodes, so the kernels
+// below read heights from one flat array in either gravity mode
+static double *elev = NULL;
+
+// the nodes in the order find_flow accumulated them, every node
+// ahead of all of the nodes it drains into
+static node_ptr *flow_order = NULL;
+static int num_flow_order = 0;
+
+/*
+ * set_gravity_center switches flow routing, erosion and slumping over
+ * to radial gravity toward center, for eroding whole moons or planets
+ */
+void set_gravity_center(VEC center) {
+   radial_gravity = TRUE;
+   gravity_center = center;
+}
+
+// move a node to the given elevation, straight up or down
+static void set_node_elev(node_ptr this_node, double h) {
+   if (radial_gravity) {
+      VEC r = from(gravity_center,this_node->loc);
+      double scale = h / (length(r) + 1.e-300);
+      this_node->loc.x = gravity_center.x + scale*r.x;
+      this_node->loc.y = gravity_center.y + scale*r.y;
+      this_node->loc.z = gravity_center.z + scale*r.z;
+   } else {
+      this_node->loc.z = h;
+   }
+}
+
+// how far fill_basins lifts a node above the one it drains into: the
+// writers print 8 significant digits, so a step of a few units in the
+// last of them survives output, and radial placement's few-ulp
+// rounding, without tilting filled flats more than it must; heights
+// near zero use fill_floor (a millionth of the mesh size) instead
+static double fill_floor = DBL_MIN;
+
+static double just_above(double h) {
+   return h + 3.e-7*fmax(fabs(h), fill_floor);
+}
+
+// horizontal distance between two nodes, across the gravity vector
+static inline double node_run(node_ptr a, node_ptr b) {
+   double dx = b->loc.x - a->loc.x;
+   double dy = b->loc.y - a->loc.y;
+   if (radial_gravity) {
+      double dz = b->loc.z - a->loc.z;
+      double dh = elev[b->index] - elev[a->index];
+      double run2 = dx*dx + dy*dy + dz*dz - dh*dh;
+      return (run2 > 0.0 ? sqrt(run2) : 0.0);
+   }
+   return sqrt(dx*dx+dy*dy);
+}
+
+static int gather_nodes() {
+
+   int n;
+   int num = 0;
+   node_ptr curr_node;
+
+   for (curr_node=node_head; curr_node; curr_node=curr_node->next_node)
+      curr_node->index = num++;
+   if (num > max_flow_nodes) {
+      free(flow_nodes);
+      free(elev);
+      max_flow_nodes = num;
+      flow_nodes = (node_ptr*) malloc(max_flow_nodes*sizeof(node_ptr));
+      elev = (double*) malloc(max_flow_nodes*sizeof(double));
+      if (!flow_nodes || !elev) {
+         fprintf(stderr,"Could not allocate node array for %d nodes.\n",num);
+         exit(1);
+      }
+   }
+   for (curr_node=node_head; curr_node; curr_node=curr_node->next_node)
+      flow_nodes[curr_node->index] = curr_node;
+
+   // find all elevations once, rather than per neighbor in the kernels
+   if (radial_gravity) {
+      #pragma omp parallel for schedule(static)
+      for (n=0; n<num; n++) {
+         VEC r = from(gravity_center,flow_nodes[n]->loc);
+         elev[n] = sqrt(r.x*r.x + r.y*r.y + r.z*r.z);
+      }
+   } else {
+      for (n=0; n<num; n++) elev[n] = flow_nodes[n]->loc.z;
+   }
+
+   return num;
+}
+
 
 /*
  * find_flow will determine the flow over all edges in the surface,
  * approximating rainfall as constant and ground losses as zero.
+ * With mfd_exponent > 0, each node splits its flow among all of its
+ * lower neighbors in proportion to slope^mfd_exponent (Freeman's
+ * multiple flow direction); otherwise it all goes down the steepest.
  */
-int find_flow(tri_pointer tri_head) {
+int find_flow(tri_pointer tri_head, double mfd_exponent) {
 
    int debug = 0;
-   int i;
-   //int last_solved_level;
-   //int current_level;
+   int i,n;
+   int num_nodes;
+   int num_lonely = 0;
+   int num_edges;
+   int head,tail;
    double min_z;
    double tri_area;
-   double carried_flow;
    VEC rain_from;
    VEC tri_normal;
    node_ptr curr_node;
    node_ptr low_node;
    tri_pointer curr_tri;
+   node_ptr *nodes;
+   static int max_nodes = 0;
+   static int *indeg = NULL;
+   // downhill edges of node n are edge_to/edge_wgt[edge_start[n]..edge_start[n+1]-1]
+   static int max_edges = 0;
+   static int *edge_start = NULL;
+   static int *edge_to = NULL;
+   static float *edge_wgt = NULL;
 
 
    /* Set the rain incident vector */
@@ -65,6 +179,11 @@ int find_flow(tri_pointer tri_head) {
       curr_node = curr_node->next_node;
    }
 
+   /* gather the nodes and their elevations into arrays, so the
+    * per-node work below can be split across threads */
+   num_nodes = gather_nodes();
+   nodes = flow_nodes;
+
 
    /* first determine the direct (first-order) flow, for each triangle
     * onto a specific node */
@@ -73,11 +192,11 @@ int find_flow(tri_pointer tri_head) {
 
       /* find the lowest node, save it in curr_node */
       curr_node = curr_tri->node[0];
-      min_z = curr_node->loc.z;
+      min_z = elev[curr_node->index];
       for (i=1; i<3; i++) {
-         if (curr_tri->node[i]->loc.z < min_z) {
+         if (elev[curr_tri->node[i]->index] < min_z) {
             curr_node = curr_tri->node[i];
-            min_z = curr_node->loc.z;
+            min_z = elev[curr_node->index];
          }
       }
       if (debug > 0) fprintf(stderr,"lowest node in tri is at z= %lf",min_z);
@@ -86,6 +205,17 @@ int find_flow(tri_pointer tri_head) {
       tri_area = find_area(curr_tri);
       tri_normal = find_tri_normal(curr_tri);
 
+      /* under radial gravity, rain falls toward the center */
+      if (radial_gravity) {
+         rain_from.x = curr_tri->node[0]->loc.x + curr_tri->node[1]->loc.x
+                     + curr_tri->node[2]->loc.x - 3.0*gravity_center.x;
+         rain_from.y = curr_tri->node[0]->loc.y + curr_tri->node[1]->loc.y
+                     + curr_tri->node[2]->loc.y - 3.0*gravity_center.y;
+         rain_from.z = curr_tri->node[0]->loc.z + curr_tri->node[1]->loc.z
+                     + curr_tri->node[2]->loc.z - 3.0*gravity_center.z;
+         rain_from = norm(rain_from);
+      }
+
       /* modify the total area based on the normal, to find the projected area */
       tri_area *= dot(tri_normal,rain_from);
 
@@ -100,137 +230,347 @@ int find_flow(tri_pointer tri_head) {
       curr_tri = curr_tri->next_tri;
    }
 
-   /* determine the downhill node for each node, NULL if none */
-   curr_node = node_head;
-   while (curr_node) {
+   if (num_nodes > max_nodes) {
+      free(flow_order);
+      free(indeg);
+      free(edge_start);
+      max_nodes = num_nodes;
+      flow_order = (node_ptr*) malloc(max_nodes*sizeof(node_ptr));
+      indeg = (int*) malloc(max_nodes*sizeof(int));
+      edge_start = (int*) malloc((max_nodes+1)*sizeof(int));
+      if (!flow_order || !indeg || !edge_start) {
+         fprintf(stderr,"Could not allocate flow arrays for %d nodes.\n",max_nodes);
+         exit(1);
+      }
+   }
 
-      if (curr_node->num_adj_nodes > 0) {
-         if (debug > 0) fprintf(stderr,"looking for downstream node from %d adjacent nodes\n",curr_node->num_adj_nodes);
-         min_z = curr_node->adj_node[0]->loc.z;
-         low_node = (node_ptr) curr_node->adj_node[0];
-         for (i=1; i<curr_node->num_adj_nodes; i++)
-            if (curr_node->adj_node[i]->loc.z < min_z) {
-               min_z = curr_node->adj_node[i]->loc.z;
-               low_node = (node_ptr) curr_node->adj_node[i];
-            }
+   /* determine the downhill node for each node, NULL if none */
+   #pragma omp parallel for schedule(static) reduction(+:num_lonely)
+   for (n=0; n<num_nodes; n++) {
+      node_ptr this_node = nodes[n];
+      node_ptr low = NULL;
+      double low_z;
+      int j;
+
+      /* no adjacent nodes? something is wrong. */
+      if (this_node->num_adj_nodes < 1) {
+         num_lonely++;
+         this_node->downstream = NULL;
+         continue;
+      }
 
-         /* if the lowest adjacent node is higher than the current node,
-          * then there is no downstream node, flow vanishes */
-         if (min_z < curr_node->loc.z) {
-            if (debug > 0) fprintf(stderr,"  curr_node is at z= %lf, lowest adj. node is at %lf\n",curr_node->loc.z,min_z);
-            curr_node->downstream = (node_ptr) low_node;
-         } else {
-            if (debug > 0) fprintf(stderr,"  curr_node is at z= %lf, no downstream node\n",curr_node->loc.z);
-            curr_node->downstream = (node_ptr) NULL;
+      low = (node_ptr) this_node->adj_node[0];
+      low_z = elev[low->index];
+      for (j=1; j<this_node->num_adj_nodes; j++)
+         if (elev[this_node->adj_node[j]->index] < low_z) {
+            low = (node_ptr) this_node->adj_node[j];
+            low_z = elev[low->index];
          }
 
-      } else {
-         /* no adjacent nodes? something is wrong. */
-         fprintf(stderr,"Node at x=%lf has no adjacent nodes set.\n",curr_node->loc.x);
-         fprintf(stderr,"This is a problem. Exiting.\n");
-         exit(0);
-      }
+      /* if the lowest adjacent node is higher than the current node,
+       * then there is no downstream node, flow vanishes */
+      this_node->downstream = (low_z < elev[n]) ? low : NULL;
 
-      curr_node = curr_node->next_node;
+      /* count the edges this node will pass flow along */
+      edge_start[n+1] = (this_node->downstream != NULL);
+      if (mfd_exponent > 0.0 && this_node->downstream)
+         for (j=0; j<this_node->num_adj_nodes; j++)
+            if (elev[this_node->adj_node[j]->index] < elev[n] &&
+                this_node->adj_node[j] != low) edge_start[n+1]++;
+
+      /* save the amount of direct (level 0) flow into each node */
+      this_node->temp_loc.x = this_node->flow_rate;
+   }
+   if (num_lonely > 0) {
+      fprintf(stderr,"%d nodes have no adjacent nodes set.\n",num_lonely);
+      fprintf(stderr,"This is a problem. Exiting.\n");
+      exit(0);
    }
 
 
    /* now, the hard part, determine the flow at all nodes, assuming no
     * losses to groundwater */
 
+   /* lay the downhill edges out compactly, in node order */
+   edge_start[0] = 0;
+   for (n=0; n<num_nodes; n++) edge_start[n+1] += edge_start[n];
+   num_edges = edge_start[num_nodes];
+   if (num_edges > max_edges) {
+      free(edge_to);
+      free(edge_wgt);
+      max_edges = num_edges;
+      edge_to = (int*) malloc(max_edges*sizeof(int));
+      edge_wgt = (float*) malloc(max_edges*sizeof(float));
+      if (!edge_to || !edge_wgt) {
+         fprintf(stderr,"Could not allocate flow arrays for %d edges.\n",max_edges);
+         exit(1);
+      }
+   }
 
-   /* I am going to solve this the dumb, inefficient way for now. */
+   #pragma omp parallel for schedule(static)
+   for (n=0; n<num_nodes; n++) {
+      node_ptr this_node = nodes[n];
+      int j, k = edge_start[n];
+      double wsum = 0.0;
+      double wgt[MAX_ADJ];
+
+      if (k == edge_start[n+1]) continue;
+      if (k+1 == edge_start[n+1]) {
+         edge_to[k] = this_node->downstream->index;
+         edge_wgt[k] = 1.0;
+         continue;
+      }
 
-   /* for each node with direct flow, follow the list of downstream nodes
-    * and add that amount of direct flow to each one. It's dumb, but it works. */
-   /* but, first, save the amount of direct (level 0) flow into each node */
-   curr_node = node_head;
-   while (curr_node) {
-      curr_node->temp_loc.x = curr_node->flow_rate;
-      curr_node = curr_node->next_node;
+      /* weight each lower neighbor by its slope to the power given */
+      for (j=0; j<this_node->num_adj_nodes; j++) {
+         node_ptr adj = (node_ptr) this_node->adj_node[j];
+         if (elev[adj->index] >= elev[n]) continue;
+         wgt[k-edge_start[n]] = pow((elev[n] - elev[adj->index]) /
+                                    (node_run(this_node,adj) + 1.e-20), mfd_exponent);
+         wsum += wgt[k-edge_start[n]];
+         edge_to[k++] = adj->index;
+      }
+      for (k=edge_start[n]; k<edge_start[n+1]; k++)
+         edge_wgt[k] = wgt[k-edge_start[n]] / wsum;
    }
 
-   curr_node = node_head;
-   while (curr_node) {
-      carried_flow = curr_node->temp_loc.x;	/* the original direct flow only */
-      if (debug > 0) fprintf(stderr,"node has direct flow of %lf",carried_flow);
-      if (carried_flow > 0.0) {
-         if (debug > 0) fprintf(stderr,", flowing");
-         low_node = (node_ptr) curr_node->downstream;
-         while (low_node) {
-            if (debug > 0) fprintf(stderr,".");
-            low_node->flow_rate += carried_flow;
-            low_node = (node_ptr) low_node->downstream;
-         }
+   /* every edge goes to a strictly lower node, so there are no loops;
+    * count the upstream edges into each node */
+   for (n=0; n<num_nodes; n++) indeg[n] = 0;
+   for (i=0; i<num_edges; i++) indeg[edge_to[i]]++;
+
+   /* then pass each node's total flow down once all of its upstream
+    * nodes have been added in */
+   head = 0;
+   tail = 0;
+   for (n=0; n<num_nodes; n++)
+      if (indeg[n] == 0) flow_order[tail++] = nodes[n];
+   while (head < tail) {
+      curr_node = flow_order[head++];
+      n = curr_node->index;
+      for (i=edge_start[n]; i<edge_start[n+1]; i++) {
+         low_node = nodes[edge_to[i]];
+         low_node->flow_rate += edge_wgt[i] * curr_node->flow_rate;
+         if (--indeg[edge_to[i]] == 0) flow_order[tail++] = low_node;
       }
-      if (debug > 0) fprintf(stderr,"\n");
-      curr_node = curr_node->next_node;
    }
+   num_flow_order = tail;
+   if (debug > 0) fprintf(stderr,"accumulated flow over %d of %d nodes\n",tail,num_nodes);
 
 
-/* *******************   CRAP   *********************************************
-   last_solved_level = 0;
-   current_level = 1;
-   while () {
+   // (void) write_flow_data();
+
+   return 0;
+}
 
-      // first, identify the nodes that will be solved for on this level
-      curr_node = node_head;
-      while (curr_node) {
-         if (curr_node->index == last_solved_level) {
-            curr_node->downstream->index = current_level;
-         }
-         curr_node = curr_node->next_node;
-      }
 
-      // then, go through all nodes at this level and solve for their flow
-      curr_node = node_head;
-      while (curr_node) {
-         if (curr_node->index == current_level) {
-            curr_node->downstream->index = current_level;
+// is node a lower than node b? ties go by list order
+static int flood_lower(node_ptr a, node_ptr b) {
+   if (elev[a->index] != elev[b->index]) return (elev[a->index] < elev[b->index]);
+   return (a->index < b->index);
+}
+
+static void flood_push(node_ptr *heap, int *num, node_ptr this_node) {
+   int i = (*num)++;
+   while (i > 0 && flood_lower(this_node, heap[(i-1)/2])) {
+      heap[i] = heap[(i-1)/2];
+      i = (i-1)/2;
+   }
+   heap[i] = this_node;
+}
+
+static node_ptr flood_pop(node_ptr *heap, int *num) {
+   node_ptr top = heap[0];
+   node_ptr last = heap[--(*num)];
+   int i = 0, c;
+   while ((c = 2*i+1) < *num) {
+      if (c+1 < *num && flood_lower(heap[c+1], heap[c])) c++;
+      if (!flood_lower(heap[c], last)) break;
+      heap[i] = heap[c];
+      i = c;
+   }
+   heap[i] = last;
+   return top;
+}
+
+// visit nodes lowest-first from those in the heap, lifting any node
+// below the one it was reached from to just above it; nodes marked 1
+// in closed are already done
+static int flood_from(node_ptr *heap, int num_heap, char *closed) {
+
+   int i;
+   int num_raised = 0;
+   node_ptr curr_node;
+   node_ptr test_node;
+
+   while (num_heap > 0) {
+      curr_node = flood_pop(heap, &num_heap);
+      for (i=0; i<curr_node->num_adj_nodes; i++) {
+         test_node = (node_ptr) curr_node->adj_node[i];
+         if (closed[test_node->index] == 1) continue;
+         closed[test_node->index] = 1;
+
+         /* raise the neighbor to just above the node it drains into */
+         if (elev[test_node->index] <= elev[curr_node->index]) {
+            elev[test_node->index] = just_above(elev[curr_node->index]);
+            set_node_elev(test_node, elev[test_node->index]);
+            num_raised++;
          }
-         curr_node = curr_node->next_node;
+         flood_push(heap, &num_heap, test_node);
       }
+   }
 
+   return num_raised;
+}
 
-      // make sure last_solved_level doesn't get too high
-      if (last_solved_level > 100) break;
+/*
+ * fill_basins raises the land in every closed depression until it
+ * drains, using a priority flood (Barnes, Lehman and Mulla, 2014):
+ * starting from the open edges of the mesh (or its lowest node, if it
+ * is closed), visit nodes lowest-first, and lift any node below the
+ * one it was reached from to just above it. Every node then has a
+ * strictly lower neighbor leading out, in one O(N log N) sweep.
+ */
+int fill_basins(tri_pointer tri_head) {
 
-      break;
+   int i,n;
+   int num_nodes;
+   int num_heap = 0;
+   int num_raised = 0;
+   node_ptr curr_node;
+   node_ptr test_node;
+   node_ptr low_node;
+   node_ptr *nodes;
+   static int max_nodes = 0;
+   static node_ptr *heap = NULL;
+   static char *closed = NULL;
+
+   num_nodes = gather_nodes();
+   nodes = flow_nodes;
+   if (num_nodes < 1) return(0);
+   if (num_nodes > max_nodes) {
+      free(heap);
+      free(closed);
+      max_nodes = num_nodes;
+      heap = (node_ptr*) malloc(max_nodes*sizeof(node_ptr));
+      closed = (char*) malloc(max_nodes*sizeof(char));
+      if (!heap || !closed) {
+         fprintf(stderr,"Could not allocate fill arrays for %d nodes.\n",max_nodes);
+         exit(1);
+      }
    }
-*****************************************   END CRAP   ******************* */
 
+   /* heights below a millionth of the mesh size step as if that high */
+   {
+      VEC lo = nodes[0]->loc;
+      VEC hi = nodes[0]->loc;
+      double size;
+      for (n=1; n<num_nodes; n++) {
+         const VEC p = nodes[n]->loc;
+         if (p.x < lo.x) lo.x = p.x;
+         if (p.x > hi.x) hi.x = p.x;
+         if (p.y < lo.y) lo.y = p.y;
+         if (p.y > hi.y) hi.y = p.y;
+         if (p.z < lo.z) lo.z = p.z;
+         if (p.z > hi.z) hi.z = p.z;
+      }
+      size = fmax(hi.x-lo.x, fmax(hi.y-lo.y, hi.z-lo.z));
+      fill_floor = (size > 0.0) ? 1.e-6*size : DBL_MIN;
+   }
 
-   // (void) write_flow_data();
+   /* seed the flood with the nodes on open edges: those have one
+    * more neighbor than they have triangles */
+   for (n=0; n<num_nodes; n++) {
+      closed[n] = (nodes[n]->num_adj_nodes > nodes[n]->num_conn);
+      if (closed[n]) flood_push(heap, &num_heap, nodes[n]);
+   }
+   num_raised += flood_from(heap, num_heap, closed);
+
+   /* any closed surface left over drains through its lowest node,
+    * found with a depth-first walk (marked with 2) over it */
+   for (n=0; n<num_nodes; n++) {
+      if (closed[n]) continue;
+      low_node = nodes[n];
+      closed[n] = 2;
+      heap[0] = nodes[n];
+      num_heap = 1;
+      while (num_heap > 0) {
+         curr_node = heap[--num_heap];
+         if (flood_lower(curr_node, low_node)) low_node = curr_node;
+         for (i=0; i<curr_node->num_adj_nodes; i++) {
+            test_node = (node_ptr) curr_node->adj_node[i];
+            if (closed[test_node->index]) continue;
+            closed[test_node->index] = 2;
+            heap[num_heap++] = test_node;
+         }
+      }
+      closed[low_node->index] = 1;
+      heap[0] = low_node;
+      num_raised += flood_from(heap, 1, closed);
+   }
 
-   return 0;
+   return(num_raised);
 }
 
 
 /*
- * fill_basins tries to raise the level of land where there is
- * no downstream node
+ * erode_surface lowers the land by the stream-power law,
+ * dz/dt = -erosion_rate * flow^area_exp * slope^slope_exp, where flow
+ * is the upstream area from find_flow and slope is taken toward the
+ * downstream node. For slope_exp > 0 this is solved implicitly (Braun
+ * and Willett, 2013): walking the nodes from the outlets upward, each
+ * node moves toward its already-lowered downstream node, so it can
+ * never cut below it and large rates stay stable. With slope_exp = 0
+ * the erosion does not depend on z, and every node is simply lowered.
  */
-int fill_basins(tri_pointer tri_head) {
+int erode_surface(tri_pointer tri_head, double erosion_rate,
+                  double area_exp, double slope_exp) {
 
-   int i;
-   double min_z;
+   int n,iter;
+   double fac,dz,x,x0,f,fp;
    node_ptr curr_node;
+   node_ptr low_node;
 
-   curr_node = node_head;
-   while (curr_node) {
-      if (!curr_node->downstream) {
+   // the elevations in elev[] are still those find_flow gathered
+   if (slope_exp <= 0.0) {
+      for (n=0; n<num_flow_order; n++) {
+         curr_node = flow_order[n];
+         elev[curr_node->index] -= erosion_rate*pow(curr_node->flow_rate,area_exp);
+         set_node_elev(curr_node, elev[curr_node->index]);
+      }
+      return(1);
+   }
 
-         /* find the lowest neighbor node */
-         min_z = curr_node->adj_node[0]->loc.z;
-         for (i=1; i<curr_node->num_adj_nodes; i++)
-            if (curr_node->adj_node[i]->loc.z < min_z)
-               min_z = curr_node->adj_node[i]->loc.z;
+   // the downstream nodes come later in flow_order, so walk it backward
+   for (n=num_flow_order-1; n>=0; n--) {
+      curr_node = flow_order[n];
+      low_node = (node_ptr) curr_node->downstream;
 
-         /* raise the current node to just above that lowest neighbor node */
-         curr_node->loc.z = min_z+0.0005;
+      // outlets and sinks hold the base level
+      if (!low_node) continue;
 
+      fac = erosion_rate * pow(curr_node->flow_rate,area_exp) /
+            pow(node_run(low_node,curr_node) + 1.e-20, slope_exp);
+
+      // solve x - x0 + fac*x^slope_exp = 0 for the new height x above
+      // the downstream node; linear in x for the usual slope_exp of 1
+      x0 = elev[curr_node->index] - elev[low_node->index];
+      if (x0 <= 0.0) continue;
+      if (slope_exp == 1.0) {
+         x = x0 / (1.0 + fac);
+      } else {
+         x = x0;
+         for (iter=0; iter<20; iter++) {
+            f = x - x0 + fac*pow(x,slope_exp);
+            fp = 1.0 + slope_exp*fac*pow(x,slope_exp-1.0);
+            dz = f/fp;
+            x -= dz;
+            if (x <= 0.0) x = 1.e-6*x0;
+            if (fabs(dz) < 1.e-10*x0) break;
+         }
       }
-      curr_node = curr_node->next_node;
+      elev[curr_node->index] = elev[low_node->index] + x;
+      set_node_elev(curr_node, elev[curr_node->index]);
    }
 
    return(1);
@@ -238,24 +578,99 @@ int fill_basins(tri_pointer tri_head) {
 
 
 /*
- * Ideally, erode_surface takes the flow at all nodes and computes
- * any land levelling (+-z) that should take place. Fluvial erosion
- * depends not only on flow volume, but speed.
+ * slump_surface is thermal erosion: wherever the slope from a node to a
+ * lower neighbor is steeper than the angle of repose (in degrees), half
+ * of the largest excess drop leaves the node and is shared among those
+ * lower neighbors in proportion to their excess (Musgrave et al.,
+ * 1989). Each pass reads the heights from one buffer and writes them
+ * to another, so nodes are updated in parallel without races. Passes
+ * repeat until no excess is left or max_passes have run; returns the
+ * number of passes done.
  */
-int erode_surface(tri_pointer tri_head, double erosion_rate) {
-
-   node_ptr curr_node;
-
-   curr_node = node_head;
-   while (curr_node) {
+int slump_surface(tri_pointer tri_head, double repose, int max_passes) {
+
+   int n,pass;
+   int num_nodes;
+   double tan_repose = tan(repose*M_PI/180.0);
+   double max_excess = 0.0;
+   double *ztemp;
+   node_ptr *nodes;
+   static int max_nodes = 0;
+   static double *zold = NULL;
+   static double *znew = NULL;
+   static double *zout = NULL;
+   static double *zsum = NULL;
+
+   num_nodes = gather_nodes();
+   nodes = flow_nodes;
+   if (num_nodes > max_nodes) {
+      free(zold);
+      free(znew);
+      free(zout);
+      free(zsum);
+      max_nodes = num_nodes;
+      zold = (double*) malloc(max_nodes*sizeof(double));
+      znew = (double*) malloc(max_nodes*sizeof(double));
+      zout = (double*) malloc(max_nodes*sizeof(double));
+      zsum = (double*) malloc(max_nodes*sizeof(double));
+      if (!zold || !znew || !zout || !zsum) {
+         fprintf(stderr,"Could not allocate slump arrays for %d nodes.\n",max_nodes);
+         exit(1);
+      }
+   }
 
-      // here's the erosion
-      curr_node->loc.z -= erosion_rate*curr_node->flow_rate;
+   for (n=0; n<num_nodes; n++) zold[n] = elev[n];
+
+   for (pass=0; pass<max_passes; pass++) {
+
+      // how much each node sheds, and the total excess it sheds over
+      max_excess = 0.0;
+      #pragma omp parallel for schedule(static) reduction(max:max_excess)
+      for (n=0; n<num_nodes; n++) {
+         node_ptr this_node = nodes[n];
+         double biggest = 0.0, total = 0.0;
+         int j;
+         for (j=0; j<this_node->num_adj_nodes; j++) {
+            node_ptr adj = (node_ptr) this_node->adj_node[j];
+            double excess = zold[n] - zold[adj->index] - tan_repose*node_run(this_node,adj);
+            if (excess > 0.0) {
+               total += excess;
+               if (excess > biggest) biggest = excess;
+            }
+         }
+         zout[n] = 0.5*biggest;
+         zsum[n] = total;
+         if (biggest > max_excess) max_excess = biggest;
+      }
+      if (max_excess < 1.e-9) break;
+
+      // each node loses what it sheds and gathers its share of what
+      // each steeper, higher neighbor sheds
+      #pragma omp parallel for schedule(static)
+      for (n=0; n<num_nodes; n++) {
+         node_ptr this_node = nodes[n];
+         double z = zold[n] - zout[n];
+         int j;
+         for (j=0; j<this_node->num_adj_nodes; j++) {
+            node_ptr adj = (node_ptr) this_node->adj_node[j];
+            int a = adj->index;
+            double excess;
+            if (zout[a] == 0.0) continue;
+            excess = zold[a] - zold[n] - tan_repose*node_run(this_node,adj);
+            if (excess > 0.0) z += zout[a]*excess/zsum[a];
+         }
+         znew[n] = z;
+      }
 
-      curr_node = curr_node->next_node;
+      ztemp = zold;
+      zold = znew;
+      znew = ztemp;
    }
 
-   return(1);
+   for (n=0; n<num_nodes; n++)
+      if (zold[n] != elev[n]) set_node_elev(nodes[n], zold[n]);
+
+   return(pass);
 }
 
 
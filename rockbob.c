@@ -38,7 +38,8 @@ node_ptr node_head = NULL;
 norm_ptr norm_head = NULL;
 text_ptr text_head = NULL;
 
-extern int write_bob(tri_pointer,double*,double*,double*,double,double,int,double,double,char*);
+extern int write_bob(tri_pointer,double*,double*,double*,double,double,int,double,double,int,char*,tri_pointer*);
+extern int write_bob_from_brick(char*,double*,double*,double*,double,int,double,double,char*,tri_pointer*);
 int Usage(char[MAX_FN_LEN],int);
 
 int main(int argc,char **argv) {
@@ -52,10 +53,13 @@ int main(int argc,char **argv) {
    double thickness;				/* thickness of mesh, world coords */
    double repose;				/* angle of repose (45-90), negative turns off */
    double erode;				/* number of cells to erode the volume, neg is dilate */
+   int do_sdf = FALSE;				/* write signed distance instead of shell */
    double xb[3],yb[3],zb[3];			/* bounds, in world units, [t/f,min,max] */
    tri_pointer tri_head = NULL;
+   tri_pointer mesh = NULL;			/* contoured brick, for mesh output */
 
    // negative means "not being used"
+   strcpy(output_format,"bob");
    dx = -1.0;
    thickness = -1.0;
    repose = -45.0;
@@ -107,17 +111,30 @@ int main(int argc,char **argv) {
          repose = atof(argv[++i]);
       } else if (strncmp(argv[i], "-erode", 3) == 0) {
          erode = atof(argv[++i]);
+      } else if (strncmp(argv[i], "-sdf", 3) == 0) {
+         do_sdf = TRUE;
       } else if (strncmp(argv[i], "-o", 2) == 0) {
          strncpy(output_format,argv[i]+2,3);
+         output_format[3] = '\0';
       } else
          (void) Usage(progname,0);
    }
 
-   /* Read the input file */
-   tri_head = read_input(infile,FALSE,NULL);
+   /* A brick is read and filtered as it is, anything else is voxelized */
+   const char* extension = infile + strlen(infile) - 3;
+   if (strncmp(extension, "bob", 3) == 0 || strncmp(extension, "bos", 3) == 0 ||
+       strncmp(extension, "bof", 3) == 0) {
+      (void) write_bob_from_brick(infile,xb,yb,zb,dx,diffuseSteps,repose,erode,output_format,&mesh);
+   } else {
+      /* Read the input file */
+      tri_head = read_input(infile,FALSE,NULL);
+
+      /* Write the image to stdout */
+      (void) write_bob(tri_head,xb,yb,zb,dx,thickness,diffuseSteps,repose,erode,do_sdf,output_format,&mesh);
+   }
 
-   /* Write the image to stdout */
-   (void) write_bob(tri_head,xb,yb,zb,dx,thickness,diffuseSteps,repose,erode,output_format);
+   /* Or write the mesh contoured from it */
+   if (mesh) (void) write_output(mesh,output_format,FALSE,argc,argv);
 
    fprintf(stderr,"Done.\n");
    exit(0);
@@ -157,12 +174,22 @@ int Usage(char progname[MAX_FN_LEN],int status) {
        "               number of cells to erode (shrink) the volume, negative      ",
        "               will dilate (grow) instead (default=0)                      ",
        "                                                                           ",
-       "   -okey       specify output format, key= bob, bof, default = bob         ",
+       "   -sdf        write the signed distance to the mesh instead, in world     ",
+       "               units and negative inside, exact near the mesh; needs a     ",
+       "               closed mesh, and is always written as bof                   ",
+       "                                                                           ",
+       "   -okey       specify output format, key= bob (bytes), bos (16-bit        ",
+       "               shorts), bof (floats, 0..1), default = bob; or a mesh       ",
+       "               format (obj, raw, tin, rad, pov, rib, wrl) to contour the   ",
+       "               brick back into triangles at its half level                 ",
        "                                                                           ",
        "   -help       returns this help information                               ",
        " ",
        "The input file can be of .obj, .raw, or .tin format, and the program requires",
        "   the input file to use its valid 3-character filename extension.",
+       "It can also be a .bob, .bos, or .bof brick, which is filtered and written",
+       "   again, or contoured; then -dx sets its voxel size (default 1), and the",
+       "   low -xb, -yb, and -zb bounds its corner (default 0).",
        " ",
        "Options may be abbreviated to an unambiguous length (duh).",
        "Output is to stdout",
@@ -38,9 +38,11 @@ text_ptr text_head = NULL;
 int num_tri = 0;
 
 int Usage(char[MAX_FN_LEN],int);
-extern int find_flow(tri_pointer);
+extern int find_flow(tri_pointer, double);
 extern int fill_basins(tri_pointer);
-extern int erode_surface(tri_pointer, double);
+extern int erode_surface(tri_pointer, double, double, double);
+extern int slump_surface(tri_pointer, double, int);
+extern void set_gravity_center(VEC);
 
 int main(int argc,char **argv) {
 
@@ -49,6 +51,11 @@ int main(int argc,char **argv) {
    int total_steps = 1;			/* total number of erosion steps */
    int do_erosion= 0;			/* perturb nodes to smooth shape? */
    double erosion_factor = 0.0;		/* amount of smoothing to take place */
+   double mfd_exponent = 0.0;		/* split flow among lower nodes if >0 */
+   double area_exp = 1.0;		/* stream-power exponent on flow */
+   double slope_exp = 0.0;		/* stream-power exponent on slope */
+   double repose = 0.0;			/* angle of repose for slumping, degrees */
+   VEC center;				/* center of radial gravity */
    //double v_thresh = 1.0;		/* threshhold for common normal, convex edge */
    //double c_thresh = 1.0;		/* threshhold for common normal, concave edge */
    char infile[MAX_FN_LEN];			/* name of input file, TIN only for starters */
@@ -70,6 +77,27 @@ int main(int argc,char **argv) {
          if (i < argc-1)
             if (strncmp(argv[i+1], "-", 1) != 0)
                erosion_factor = atof(argv[++i]);
+      } else if (strncmp(argv[i], "-m", 2) == 0) {
+         mfd_exponent = 1.1;
+         if (i < argc-1)
+            if (strncmp(argv[i+1], "-", 1) != 0)
+               mfd_exponent = atof(argv[++i]);
+      } else if (strncmp(argv[i], "-p", 2) == 0) {
+         area_exp = 0.5;
+         slope_exp = 1.0;
+         if (i < argc-2)
+            if (strncmp(argv[i+1], "-", 1) != 0) {
+               area_exp = atof(argv[++i]);
+               slope_exp = atof(argv[++i]);
+            }
+      } else if (strncmp(argv[i], "-g", 2) == 0) {
+         if (i+3 >= argc) (void) Usage(progname,0);
+         center.x = atof(argv[++i]);
+         center.y = atof(argv[++i]);
+         center.z = atof(argv[++i]);
+         (void) set_gravity_center(center);
+      } else if (strncmp(argv[i], "-r", 2) == 0) {
+         repose = atof(argv[++i]);
       } else if (strncmp(argv[i], "-s", 2) == 0) {
          total_steps = atoi(argv[++i]);
       } else if (strncmp(argv[i], "-o", 2) == 0) {
@@ -89,29 +117,27 @@ int main(int argc,char **argv) {
 
    // first, fill basins to prevent flow (rivers) from disappearing
    fprintf(stderr,"Filling basins");
-   for (step=0; step<100; step++) {
-      fprintf(stderr,".");
-      (void) find_flow(tri_head);
-      (void) fill_basins(tri_head);
-   }
-   fprintf(stderr,"\n");
+   step = fill_basins(tri_head);
+   fprintf(stderr,", raised %d nodes\n",step);
 
 
    // Then, run one or several erosion steps
-   if (do_erosion)
+   if (do_erosion || repose > 0.0)
    for (step=0; step<total_steps; step++) {
 
       fprintf(stderr,"Eroding %d.\n",step);
 
-      // Calculate the flow
-      (void) find_flow(tri_head);
+      // Fill the basins left by the last step (so flow goes somewhere)
+      if (step > 0) (void) fill_basins(tri_head);
 
-      // Fill the basins (so flow goes somewhere)
-      (void) fill_basins(tri_head);
+      // Calculate the flow and apply erosion
+      if (do_erosion) {
+         (void) find_flow(tri_head,mfd_exponent);
+         (void) erode_surface(tri_head,erosion_factor,area_exp,slope_exp);
+      }
 
-      // Apply erosion
-      (void) find_flow(tri_head);
-      (void) erode_surface(tri_head,erosion_factor);
+      // Let slopes steeper than repose slump down
+      if (repose > 0.0) (void) slump_surface(tri_head,repose,20);
    }
 
 
@@ -143,6 +169,19 @@ int Usage(char progname[MAX_FN_LEN],int status) {
        "                                                                           ",
        "   -s num      compute num erosion steps                                   ",
        "                                                                           ",
+       "   -p [m n]    erode by the stream-power law, rate * flow^m * slope^n,     ",
+       "               solved implicitly so large rates stay stable; m and n       ",
+       "               default to 0.5 and 1 (without -p, m=1 and n=0, explicit)    ",
+       "                                                                           ",
+       "   -r angle    after each step, let slopes steeper than this angle of      ",
+       "               repose (in degrees) slump down onto their lower neighbors   ",
+       "                                                                           ",
+       "   -m [exp]    route flow to all lower neighbors, weighted by slope^exp,   ",
+       "               instead of only to the steepest; exp defaults to 1.1        ",
+       "                                                                           ",
+       "   -g x y z    use radial gravity toward the point (x,y,z), for eroding    ",
+       "               moons or planets; default is gravity along -z               ",
+       "                                                                           ",
        "   -okey       specify output format, key= raw, rad, pov, obj, tin, rib    ",
        "               default = raw                                               ",
        "                                                                           ",
@@ -40,8 +40,10 @@ text_ptr text_head = NULL;
 int num_tri = 0;
 
 int Usage(char[MAX_FN_LEN],int);
-extern int three_d_laplace(tri_pointer,int);
+extern int three_d_laplace(tri_pointer,int,double);
+extern int implicit_laplace(tri_pointer,double,int);
 extern int three_d_surface_tension(tri_pointer,double);
+extern int bilateral_normal_filter(tri_pointer,int,double);
 extern int compute_normals_2(tri_pointer,int);
 extern int compute_normals_3(tri_pointer,int,int,double);
 extern int grow_surface_along_normal(tri_pointer,double);
@@ -52,6 +54,15 @@ int main(int argc,char **argv) {
    int i;
    int do_laplace = FALSE;		/* perturb nodes to smooth shape? */
    int laplace_factor = 1;		/* amount of smoothing to take place */
+   double pass_band = 0.0;		/* Taubin pass-band, no inflating if 0 */
+
+   int do_implicit = FALSE;		/* smooth in one implicit step? */
+   double implicit_time = 1.0;		/* length of that step */
+   int use_cotan = FALSE;		/* with cotangent, not uniform, weights */
+
+   int do_bilateral = FALSE;		/* smooth but keep sharp features? */
+   int bilateral_iters = 10;		/* number of normal filtering passes */
+   double bilateral_sigma = 0.35;	/* normal difference that is a feature */
 
    int do_tension = FALSE;		/* perturb nodes to smooth shape? */
    double tension_factor = 1.0;		/* amount of smoothing to take place */
@@ -87,6 +98,31 @@ int main(int argc,char **argv) {
          if (i < argc-1)
             if (strncmp(argv[i+1], "-", 1) != 0)
                laplace_factor = atoi(argv[++i]);
+      } else if (strncmp(argv[i], "-f", 2) == 0) {
+         char *num_end;
+         if (i+1 >= argc) (void) Usage(progname,0);
+         do_implicit = TRUE;
+         implicit_time = strtod(argv[++i],&num_end);
+         if (num_end == argv[i]) (void) Usage(progname,0);
+         if (implicit_time < 0.) {
+            fprintf(stderr,"Implicit smoothing time (-f) cannot be negative.\n");
+            exit(1);
+         }
+      } else if (strncmp(argv[i], "-c", 2) == 0) {
+         use_cotan = TRUE;
+      } else if (strncmp(argv[i], "-m", 2) == 0) {
+         pass_band = 0.1;
+         if (i < argc-1)
+            if (strncmp(argv[i+1], "-", 1) != 0)
+               pass_band = atof(argv[++i]);
+      } else if (strncmp(argv[i], "-b", 2) == 0) {
+         do_bilateral = TRUE;
+         if (i < argc-1)
+            if (strncmp(argv[i+1], "-", 1) != 0)
+               bilateral_iters = atoi(argv[++i]);
+         if (i < argc-1)
+            if (strncmp(argv[i+1], "-", 1) != 0)
+               bilateral_sigma = atof(argv[++i]);
       } else if (strncmp(argv[i], "-a", 2) == 0) {
          allow_sharp_edges = TRUE;
          if (i < argc-1)
@@ -125,10 +161,12 @@ int main(int argc,char **argv) {
    tri_head = read_input(infile,do_invert,NULL);
 
    // first, set node connectivity
-   if (do_laplace) (void) set_node_connectivity();
+   if (do_laplace || do_implicit || do_bilateral) (void) set_node_connectivity();
 
    // Optionally smooth the surface by moving node locations - no normals needed
-   if (do_laplace) (void) three_d_laplace(tri_head,laplace_factor);
+   if (do_implicit) (void) implicit_laplace(tri_head,implicit_time,use_cotan);
+   if (do_laplace) (void) three_d_laplace(tri_head,laplace_factor,pass_band);
+   if (do_bilateral) (void) bilateral_normal_filter(tri_head,bilateral_iters,bilateral_sigma);
    if (do_tension) (void) three_d_surface_tension(tri_head,tension_factor);
 
    // Define sharp edges by splitting nodes along the edges, thus any
@@ -174,6 +212,24 @@ int Usage(char progname[MAX_FN_LEN],int status) {
     "               Optional value indicates number of smoothing passes,        ",
     "               integer values only, default = 1                            ",
     "                                                                           ",
+    "   -m [val]    with -s, follow each smoothing pass with an inflating one   ",
+    "               (Taubin's lambda/mu method) so that many passes do not      ",
+    "               shrink the mesh; optional value is the pass-band frequency, ",
+    "               default = 0.1                                               ",
+    "                                                                           ",
+    "   -f val      smooth the mesh in one implicit step, equivalent to very    ",
+    "               many small -s passes; features smaller than about sqrt(val) ",
+    "               edge lengths are removed                                    ",
+    "                                                                           ",
+    "   -c          with -f, use cotangent weights, so that the smoothing scale ",
+    "               sqrt(val) is in model units and uneven meshes smooth evenly ",
+    "                                                                           ",
+    "   -b [n s]    smooth the mesh but keep its creases and ridges by first   ",
+    "               filtering the triangle normals n times, default = 10, then  ",
+    "               moving the nodes to fit them; normals differing by more     ",
+    "               than about s (a unit-vector distance) are treated as a      ",
+    "               feature, default = 0.35                                     ",
+    "                                                                           ",
     "   -t [val]    smooth surface using surface tension algorithm, optional    ",
     "               argument is coefficient of surface tension, default = 1.0   ",
     "                                                                           ",
@@ -29,6 +29,10 @@
 #include <string.h>
 #include <math.h>
 
+#ifdef _OPENMP
+  #include <omp.h>
+#endif
+
 /* define a C preprocessor variable so that when structs.h is included,
  * it will contain extra information used only by this program */
 #define MODULE_ROCKXRAY
@@ -154,7 +158,8 @@ typedef enum render_type {
    edges        // render triangle edges only
 } RENDER;
 
-extern int write_xray(tri_pointer,VEC,double*,double*,double*,int,double,int,double,int,double,double,int,int,int,int,char*,char*,int);
+extern int write_xray(tri_pointer,VEC,double*,double*,double*,int,double,int,double,int,double,double,int,int,int,int,char*,char*,int,int,int,int,char*);
+extern int retone_xray(char*,double,double,int,int,char*,char*,int,int);
 int Usage(char[MAX_FN_LEN],int);
 
 int main(int argc,char **argv) {
@@ -162,6 +167,11 @@ int main(int argc,char **argv) {
    RENDER rtype;
    int i,do_fade,max_size,force_square,quality,write_hibit;
    int force_num_threads = -1;
+   int use_half = FALSE;			// accumulate in half floats
+   int use_slab = FALSE;			// render layers in depth order
+   int png_level = -1;				// zlib level, -1 is libpng's default
+   char* cache_file = NULL;			/* save raw image sums here */
+   char cache_base[MAX_FN_LEN] = "";		/* same, less any .rxc, for views */
    int num_layers;				// how many layers to render to?
    int do6 = FALSE;
    int do19 = FALSE;
@@ -229,6 +239,12 @@ int main(int argc,char **argv) {
          zb[0] = +1.0;
          zb[1] = atof(argv[++i]);
          zb[2] = atof(argv[++i]);
+      } else if (strncmp(argv[i], "-z", 2) == 0) {
+         png_level = atoi(argv[++i]);
+         if (png_level > 9) png_level = 9;
+         if (png_level < 0) png_level = 0;
+      } else if (strncmp(argv[i], "-slab", 3) == 0) {
+         use_slab = TRUE;
       } else if (strncmp(argv[i], "-s", 2) == 0) {
          rtype = surface;
       } else if (strncmp(argv[i], "-fade", 3) == 0) {
@@ -271,6 +287,8 @@ int main(int argc,char **argv) {
          do76 = TRUE;
       } else if (strncmp(argv[i], "-doview", 4) == 0) {
          this_view = atoi(argv[++i]);
+      } else if (strncmp(argv[i], "-cache", 2) == 0) {
+         cache_file = argv[++i];
       } else if (strncmp(argv[i], "-d", 2) == 0) {
          viewp.x = atof(argv[++i]);
          viewp.y = atof(argv[++i]);
@@ -284,6 +302,8 @@ int main(int argc,char **argv) {
          strcpy(out_prefix,argv[++i]);
       } else if (strncmp(argv[i], "-n", 2) == 0) {
          force_num_threads = atoi(argv[++i]);
+      } else if (strncmp(argv[i], "-half", 3) == 0) {
+         use_half = TRUE;
       } else {
          fprintf(stderr,"\nUnrecognized argument (%s)\n",argv[i]);
          fflush(stderr);
@@ -301,22 +321,48 @@ int main(int argc,char **argv) {
       strcpy(out_prefix,"out");
    }
 
+   /* A cache file needs only its tone mapping re-done */
+   if (strlen(infile) > 4 && strncmp(infile+strlen(infile)-4, ".rxc", 4) == 0) {
+      if (retone_xray(infile,peak_crop,gamma,write_hibit,do_fade,out_prefix,
+                      output_format,force_num_threads,png_level) != 0) exit(1);
+      fprintf(stderr,"Done.\n");
+      exit(0);
+   }
+
+   /* Each view gets its own cache, named from the given one */
+   if (cache_file) {
+      snprintf(cache_base, MAX_FN_LEN, "%s", cache_file);
+      if (strlen(cache_base) > 4 && strncmp(cache_base+strlen(cache_base)-4, ".rxc", 4) == 0)
+         cache_base[strlen(cache_base)-4] = '\0';
+   }
+
    /* Read the input file */
    tri_head = read_input(infile,FALSE,NULL);
 
+   /* Views render one at a time, but each view's images are encoded
+    * by the second thread here while the next view renders */
+#ifdef _OPENMP
+   omp_set_max_active_levels(2);
+#endif
+#pragma omp parallel num_threads(2) if(do6 || do19 || do76)
+#pragma omp single
+{
    if (do6) {
       for (int i=0; i<6; i++) {
        if (this_view == -1 || i == this_view) {
          // append an index to the output prefix
          char new_prefix[MAX_FN_LEN];
          sprintf(new_prefix, "%s_v%02d", out_prefix, i);
+         char new_cache[MAX_FN_LEN];
+         if (cache_file) snprintf(new_cache, MAX_FN_LEN, "%s_v%02d.rxc", cache_base, i);
          fprintf(stderr,"\nRendering number %d of %d to %s\n", i, 6, new_prefix);
          // set the viewpoint
          viewp = six_views[i];
          // render the image
          (void) write_xray(tri_head,viewp,xb,yb,zb,max_size,thickness,force_square,
                            border,quality,peak_crop,gamma,write_hibit,rtype,do_fade,
-                           num_layers,new_prefix,output_format,force_num_threads);
+                           num_layers,new_prefix,output_format,force_num_threads,use_half,use_slab,
+                           png_level,cache_file ? new_cache : NULL);
        }
       }
 
@@ -326,13 +372,16 @@ int main(int argc,char **argv) {
          // append an index to the output prefix
          char new_prefix[MAX_FN_LEN];
          sprintf(new_prefix, "%s_v%02d", out_prefix, i);
+         char new_cache[MAX_FN_LEN];
+         if (cache_file) snprintf(new_cache, MAX_FN_LEN, "%s_v%02d.rxc", cache_base, i);
          fprintf(stderr,"\nRendering number %d of %d to %s\n", i, 19, new_prefix);
          // set the viewpoint
          viewp = nineteen_views[i];
          // render the image
          (void) write_xray(tri_head,viewp,xb,yb,zb,max_size,thickness,force_square,
                            border,quality,peak_crop,gamma,write_hibit,rtype,do_fade,
-                           num_layers,new_prefix,output_format,force_num_threads);
+                           num_layers,new_prefix,output_format,force_num_threads,use_half,use_slab,
+                           png_level,cache_file ? new_cache : NULL);
        }
       }
 
@@ -342,13 +391,16 @@ int main(int argc,char **argv) {
          // append an index to the output prefix
          char new_prefix[MAX_FN_LEN];
          sprintf(new_prefix, "%s_v%02d", out_prefix, i);
+         char new_cache[MAX_FN_LEN];
+         if (cache_file) snprintf(new_cache, MAX_FN_LEN, "%s_v%02d.rxc", cache_base, i);
          fprintf(stderr,"\nRendering number %d of %d to %s\n", i, 76, new_prefix);
          // set the viewpoint
          viewp = seventysix_views[i];
          // render the image
          (void) write_xray(tri_head,viewp,xb,yb,zb,max_size,thickness,force_square,
                            border,quality,peak_crop,gamma,write_hibit,rtype,do_fade,
-                           num_layers,new_prefix,output_format,force_num_threads);
+                           num_layers,new_prefix,output_format,force_num_threads,use_half,use_slab,
+                           png_level,cache_file ? new_cache : NULL);
        }
       }
 
@@ -356,8 +408,10 @@ int main(int argc,char **argv) {
       /* Just write one image to stdout */
       (void) write_xray(tri_head,viewp,xb,yb,zb,max_size,thickness,force_square,
                         border,quality,peak_crop,gamma,write_hibit,rtype,do_fade,
-                        num_layers,out_prefix,output_format,force_num_threads);
+                        num_layers,out_prefix,output_format,force_num_threads,use_half,use_slab,
+                        png_level,cache_file);
    }
+} // end omp section
 
    fprintf(stderr,"Done.\n");
    exit(0);
@@ -388,6 +442,11 @@ int Usage(char progname[MAX_FN_LEN],int status) {
        "                                                                           ",
        "   -prefix p   prefix every z-layer with this ('out' writes 'out_00.png')  ",
        "                                                                           ",
+       "   -half       accumulate in 16-bit floats, halves memory use for -layers  ",
+       "                                                                           ",
+       "   -slab       render -layers in depth order, keeping in memory only as    ",
+       "               many layers as the deepest triangle spans                   ",
+       "                                                                           ",
        "   -f          force output image to be a square                           ",
        "                                                                           ",
        "   -b frac     size of border around geometry, as fraction of image size,  ",
@@ -429,7 +488,15 @@ int Usage(char progname[MAX_FN_LEN],int status) {
        "                                                                           ",
        "   -n num      force this number of threads (default is number of cores)   ",
        "                                                                           ",
+       "   -cache file save the raw image sums to file (.rxc); running rockxray on  ",
+       "               that file instead of a mesh re-applies only -g, -pc, -8,    ",
+       "               -16, -fade and -o; views get file_v00.rxc, etc.             ",
+       "                                                                           ",
        "   -okey       specify output format, key= pgm, png, default = png         ",
+       "               bin writes uncompressed binary pgm, 8 or 16 bits per -8/-16 ",
+       "               raw writes float32 pixels, 1.0 is white, no header          ",
+       "                                                                           ",
+       "   -z level    png compression level 0-9, lower is faster, default=6       ",
        "                                                                           ",
        "   -help       returns this help information                               ",
        " ",
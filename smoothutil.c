@@ -30,83 +30,342 @@
 #include <math.h>
 #include "structs.h"
 
-int three_d_laplace(tri_pointer,int);
+int three_d_laplace(tri_pointer,int,double);
+int implicit_laplace(tri_pointer,double,int);
 int three_d_surface_tension(tri_pointer,double);
+int bilateral_normal_filter(tri_pointer,int,double);
 int compute_normals_2(tri_pointer,int);
 int grow_surface_along_normal(tri_pointer,double);
 int define_sharp_edges(tri_pointer,double);
 
 
+// the nodes in list order, with node->index set to their place in it,
+// and their locations gathered into a flat array
+static int gather_smooth_nodes(node_ptr **nodes, VEC **pos) {
+
+   int n = 0;
+   node_ptr curr_node;
+
+   for (curr_node=node_head; curr_node; curr_node=curr_node->next_node)
+      curr_node->index = n++;
+
+   *nodes = (node_ptr*) malloc(n*sizeof(node_ptr));
+   *pos = (VEC*) malloc(2*n*sizeof(VEC));
+   if (n > 0 && (!*nodes || !*pos)) {
+      fprintf(stderr,"Could not allocate smoothing arrays for %d nodes.\n",n);
+      exit(1);
+   }
+
+   for (curr_node=node_head; curr_node; curr_node=curr_node->next_node) {
+      (*nodes)[curr_node->index] = curr_node;
+      (*pos)[curr_node->index] = curr_node->loc;
+   }
+
+   return n;
+}
+
+
+// the adjacent nodes of node n are adj[adj_start[n]..adj_start[n+1]-1],
+// in the order of its adj_node[] list
+static int* gather_adjacency(node_ptr *nodes, int num_nodes, int **adj_start) {
+
+   int i,n;
+   int *adj;
+   int *start = (int*) malloc((num_nodes+1)*sizeof(int));
+
+   start[0] = 0;
+   for (n=0; n<num_nodes; n++)
+      start[n+1] = start[n] + nodes[n]->num_adj_nodes;
+   adj = (int*) malloc((start[num_nodes]+1)*sizeof(int));
+   if (!start || !adj) {
+      fprintf(stderr,"Could not allocate adjacency for %d nodes.\n",num_nodes);
+      exit(1);
+   }
+   #pragma omp parallel for private(i) schedule(static)
+   for (n=0; n<num_nodes; n++)
+      for (i=0; i<nodes[n]->num_adj_nodes; i++)
+         adj[start[n]+i] = nodes[n]->adj_node[i]->index;
+
+   *adj_start = start;
+   return adj;
+}
+
+
 /*
  * Run a laplacian-like function over the entire surface to smooth the nodes
+ *
+ * Each pass moves every node toward the mean of its adjacent nodes,
+ * (x + w*mean)/(1+w) with w=0.1, reading only the last pass's
+ * locations. With pass_band > 0, every pass is followed by one with
+ * a negative weight (Taubin, SIGGRAPH 95), which undoes the shrinking
+ * while still damping frequencies above pass_band.
  */
-int three_d_laplace(tri_pointer tri_head,int num_cycles) {
-
-   int i,j;//,index;
-   //int num = 0;
-   VEC sum;//,tri_norm;
-   node_ptr curr_node = node_head;
-   //node_ptr test_node;
-   //tri_pointer test_tri;
-
+int three_d_laplace(tri_pointer tri_head,int num_cycles,double pass_band) {
+
+   int i,n,step;
+   int num_nodes;
+   int *adj_start;
+   int *adj;
+   double wgt[2];
+   VEC *pos,*newpos,*temp;
+   node_ptr *nodes;
+
+   if (num_cycles < 1) return(0);
+
+   /* gather locations, and the adjacent nodes of each in one array */
+   num_nodes = gather_smooth_nodes(&nodes,&pos);
+   newpos = pos + num_nodes;
+   adj = gather_adjacency(nodes,num_nodes,&adj_start);
+
+   /* lambda = w/(1+w) is the fraction of the way each node moves
+    * toward the mean; mu follows from 1/lambda + 1/mu = pass_band */
+   wgt[0] = 0.1;
+   wgt[1] = 0.0;
+   if (pass_band > 0.0) {
+      double lambda = wgt[0]/(1.0+wgt[0]);
+      double mu = 1.0/(pass_band - 1.0/lambda);
+      wgt[1] = mu/(1.0-mu);
+   }
 
    /* Loop this routine a number of times */
-   if (num_cycles > 0) fprintf(stderr,"Smoothing surface");
+   fprintf(stderr,"Smoothing surface");
    for (i=0; i<num_cycles; i++) {
 
       fprintf(stderr,".");
       fflush(stderr);
 
-      /* save all current node locations in the temp_node_record */
-      curr_node = node_head;
-      while (curr_node) {
-         curr_node->temp_loc.x = curr_node->loc.x;
-         curr_node->temp_loc.y = curr_node->loc.y;
-         curr_node->temp_loc.z = curr_node->loc.z;
-         curr_node = curr_node->next_node;
+      for (step=0; step<2; step++) {
+         const double w = wgt[step];
+         if (w == 0.0) continue;
+
+         /* move all nodes a short distance, based on the location
+          * of its neighbor nodes */
+         #pragma omp parallel for schedule(static)
+         for (n=0; n<num_nodes; n++) {
+            const int nadj = adj_start[n+1] - adj_start[n];
+            VEC sum;
+            int j;
+            if (nadj == 0) {
+               newpos[n] = pos[n];
+               continue;
+            }
+            sum.x = 0.0;
+            sum.y = 0.0;
+            sum.z = 0.0;
+            for (j=adj_start[n]; j<adj_start[n+1]; j++) {
+               sum.x += pos[adj[j]].x;
+               sum.y += pos[adj[j]].y;
+               sum.z += pos[adj[j]].z;
+            }
+            newpos[n].x = (pos[n].x + w*sum.x/nadj) / (1.0+w);
+            newpos[n].y = (pos[n].y + w*sum.y/nadj) / (1.0+w);
+            newpos[n].z = (pos[n].z + w*sum.z/nadj) / (1.0+w);
+         }
+
+         temp = pos;
+         pos = newpos;
+         newpos = temp;
       }
+   }
+   fprintf(stderr,"\n");
 
-      /* move all nodes a short distance, based on the location
-       * of its neighbor nodes */
-      curr_node = node_head;
-      while (curr_node) {
-
-         /* Any algorithm for this needs to use the same data that finding the
-          * surface normal would give. Is it pointless to just take a blind
-          * average of adjoining nodes? Probably not. */
-         // fprintf(stderr,"   node z=%g",curr_node->loc.z); fflush(stderr);
-
-         /* Until then, let's just use a basic Laplace-like operation */
-         sum.x = 0.0;
-         sum.y = 0.0;
-         sum.z = 0.0;
-         for (j=0; j<curr_node->num_adj_nodes; j++) {
-            sum.x += curr_node->adj_node[j]->loc.x;
-            sum.y += curr_node->adj_node[j]->loc.y;
-            sum.z += curr_node->adj_node[j]->loc.z;
+   /* apply the new locations to the nodes */
+   for (n=0; n<num_nodes; n++) nodes[n]->loc = pos[n];
+
+   free(adj);
+   free(adj_start);
+   free(pos < newpos ? pos : newpos);
+   free(nodes);
+
+   /* return some metric */
+   return(0);
+}
+
+
+/*
+ * Smooth the surface in one implicit (backward Euler) step of the
+ * Laplacian flow dx/dt = -L x, solving (I + t L) x = x0 for all three
+ * coordinates at once (Desbrun et al., SIGGRAPH 99). L is the uniform
+ * (umbrella) Laplacian, or with use_cotan the cotangent Laplacian over
+ * the lumped vertex areas; both sides are multiplied through by the
+ * degree or area, so the system is symmetric and positive definite and
+ * is solved by conjugate gradients with a Jacobi preconditioner. Features
+ * smaller than about sqrt(t), in edge lengths for the uniform Laplacian
+ * or in model units for the cotangent one, are smoothed away.
+ */
+int implicit_laplace(tri_pointer tri_head,double t,int use_cotan) {
+
+   int i,n,iter;
+   int num_nodes;
+   int max_iter = 1000;
+   int *adj_start;
+   int *adj;
+   double *diag;
+   double *aval;
+   double rz[3],rz_new[3],pq[3],rr[3],rr0[3];
+   VEC *x,*b,*r,*z,*p,*q;
+   node_ptr *nodes;
+
+   /* gather locations, and the adjacent nodes of each in one array */
+   num_nodes = gather_smooth_nodes(&nodes,&x);
+   if (num_nodes < 1) return(0);
+   adj = gather_adjacency(nodes,num_nodes,&adj_start);
+   diag = (double*) malloc(num_nodes*sizeof(double));
+   aval = (double*) malloc((adj_start[num_nodes]+1)*sizeof(double));
+   b = (VEC*) malloc(5*num_nodes*sizeof(VEC));
+   if (!diag || !aval || !b) {
+      fprintf(stderr,"Could not allocate implicit smoothing arrays.\n");
+      exit(1);
+   }
+   r = b + num_nodes;
+   z = r + num_nodes;
+   p = z + num_nodes;
+   q = p + num_nodes;
+
+   fprintf(stderr,"Smoothing surface implicitly");
+   fflush(stderr);
+
+   /* assemble A = M + t*K and b = M*x0, with K = diag(sum w) - w;
+    * the uniform Laplacian has w=1 and M the node degrees, the cotangent
+    * one has w=(cot a + cot b)/2 and M a third of the connected area */
+   #pragma omp parallel for private(i) schedule(static)
+   for (n=0; n<num_nodes; n++) {
+      const node_ptr this_node = nodes[n];
+      double mass = 0.0, wsum = 0.0;
+      int j;
+
+      if (use_cotan) {
+         for (j=adj_start[n]; j<adj_start[n+1]; j++) aval[j] = 0.0;
+         for (j=0; j<this_node->num_conn; j++) {
+            const tri_pointer this_tri = this_node->conn_tri[j];
+            const int k = this_node->conn_tri_node[j];
+            const int inext = this_tri->node[(k+1)%3]->index;
+            const int iprev = this_tri->node[(k+2)%3]->index;
+            const VEC e1 = from(x[n],x[inext]);
+            const VEC e2 = from(x[n],x[iprev]);
+            const VEC e3 = from(x[inext],x[iprev]);
+            const double area2 = length(cross(e1,e2));
+            if (area2 < 1.e-30) continue;
+            mass += area2/6.0;
+            // the edge to next is opposite the corner at prev, and the
+            // edge to prev is opposite the corner at next
+            for (i=adj_start[n]; i<adj_start[n+1]; i++) {
+               if (adj[i] == inext) aval[i] += 0.5*dot(e2,e3)/area2;
+               if (adj[i] == iprev) aval[i] -= 0.5*dot(e1,e3)/area2;
+            }
          }
-         // fprintf(stderr,"   node x=%g",curr_node->loc.x); fflush(stderr);
-         curr_node->temp_loc.x = (curr_node->temp_loc.x + 0.1*sum.x/curr_node->num_adj_nodes) / 1.1;
-         curr_node->temp_loc.y = (curr_node->temp_loc.y + 0.1*sum.y/curr_node->num_adj_nodes) / 1.1;
-         curr_node->temp_loc.z = (curr_node->temp_loc.z + 0.1*sum.z/curr_node->num_adj_nodes) / 1.1;
-         // fprintf(stderr," to x=%g\n",curr_node->loc.x); fflush(stderr);
+      } else {
+         mass = adj_start[n+1] - adj_start[n];
+         for (j=adj_start[n]; j<adj_start[n+1]; j++) aval[j] = 1.0;
+      }
 
-         curr_node = curr_node->next_node;
+      for (j=adj_start[n]; j<adj_start[n+1]; j++) {
+         wsum += aval[j];
+         aval[j] *= -t;
       }
+      if (mass <= 0.0) mass = 1.e-30;
+      diag[n] = mass + t*wsum;
+      b[n] = vscale(mass,x[n]);
+   }
 
-      /* apply the new locations to the nodes */
-      curr_node = node_head;
-      while (curr_node) {
-         curr_node->loc.x = curr_node->temp_loc.x;
-         curr_node->loc.y = curr_node->temp_loc.y;
-         curr_node->loc.z = curr_node->temp_loc.z;
-         curr_node = curr_node->next_node;
+   /* r = b - A x, z = r / diag(A), p = z */
+   for (i=0; i<3; i++) rz[i] = rr0[i] = 0.0;
+   #pragma omp parallel for schedule(static) reduction(+:rz[:3],rr0[:3])
+   for (n=0; n<num_nodes; n++) {
+      VEC ax = vscale(diag[n],x[n]);
+      int j;
+      for (j=adj_start[n]; j<adj_start[n+1]; j++) {
+         ax.x += aval[j]*x[adj[j]].x;
+         ax.y += aval[j]*x[adj[j]].y;
+         ax.z += aval[j]*x[adj[j]].z;
       }
+      r[n] = from(ax,b[n]);
+      z[n] = vscale(1.0/diag[n],r[n]);
+      p[n] = z[n];
+      rz[0] += r[n].x*z[n].x;
+      rz[1] += r[n].y*z[n].y;
+      rz[2] += r[n].z*z[n].z;
+      rr0[0] += b[n].x*b[n].x;
+      rr0[1] += b[n].y*b[n].y;
+      rr0[2] += b[n].z*b[n].z;
    }
-   if (num_cycles > 0) fprintf(stderr,"\n");
 
-   /* return some metric */
-   return(0);
+   for (iter=0; iter<max_iter; iter++) {
+
+      /* q = A p */
+      for (i=0; i<3; i++) pq[i] = 0.0;
+      #pragma omp parallel for schedule(static) reduction(+:pq[:3])
+      for (n=0; n<num_nodes; n++) {
+         VEC ap = vscale(diag[n],p[n]);
+         int j;
+         for (j=adj_start[n]; j<adj_start[n+1]; j++) {
+            ap.x += aval[j]*p[adj[j]].x;
+            ap.y += aval[j]*p[adj[j]].y;
+            ap.z += aval[j]*p[adj[j]].z;
+         }
+         q[n] = ap;
+         pq[0] += p[n].x*ap.x;
+         pq[1] += p[n].y*ap.y;
+         pq[2] += p[n].z*ap.z;
+      }
+
+      /* step each coordinate's solution, and precondition the residual */
+      {
+         const double ax = (pq[0] > 0.0) ? rz[0]/pq[0] : 0.0;
+         const double ay = (pq[1] > 0.0) ? rz[1]/pq[1] : 0.0;
+         const double az = (pq[2] > 0.0) ? rz[2]/pq[2] : 0.0;
+         for (i=0; i<3; i++) rz_new[i] = rr[i] = 0.0;
+         #pragma omp parallel for schedule(static) reduction(+:rz_new[:3],rr[:3])
+         for (n=0; n<num_nodes; n++) {
+            x[n].x += ax*p[n].x;
+            x[n].y += ay*p[n].y;
+            x[n].z += az*p[n].z;
+            r[n].x -= ax*q[n].x;
+            r[n].y -= ay*q[n].y;
+            r[n].z -= az*q[n].z;
+            z[n] = vscale(1.0/diag[n],r[n]);
+            rz_new[0] += r[n].x*z[n].x;
+            rz_new[1] += r[n].y*z[n].y;
+            rz_new[2] += r[n].z*z[n].z;
+            rr[0] += r[n].x*r[n].x;
+            rr[1] += r[n].y*r[n].y;
+            rr[2] += r[n].z*r[n].z;
+         }
+      }
+
+      if (iter%10 == 0) fprintf(stderr,".");
+      if (rr[0] <= 1.e-20*rr0[0] && rr[1] <= 1.e-20*rr0[1] &&
+          rr[2] <= 1.e-20*rr0[2]) break;
+
+      /* p = z + beta p */
+      {
+         const double bx = (rz[0] > 0.0) ? rz_new[0]/rz[0] : 0.0;
+         const double by = (rz[1] > 0.0) ? rz_new[1]/rz[1] : 0.0;
+         const double bz = (rz[2] > 0.0) ? rz_new[2]/rz[2] : 0.0;
+         #pragma omp parallel for schedule(static)
+         for (n=0; n<num_nodes; n++) {
+            p[n].x = z[n].x + bx*p[n].x;
+            p[n].y = z[n].y + by*p[n].y;
+            p[n].z = z[n].z + bz*p[n].z;
+         }
+      }
+      for (i=0; i<3; i++) rz[i] = rz_new[i];
+   }
+   fprintf(stderr,"\nConverged in %d iterations, residual %g\n",iter+1,
+           sqrt((rr[0]+rr[1]+rr[2])/(rr0[0]+rr0[1]+rr0[2]+1.e-300)));
+
+   /* apply the new locations to the nodes */
+   for (n=0; n<num_nodes; n++) nodes[n]->loc = x[n];
+
+   free(b);
+   free(aval);
+   free(diag);
+   free(adj);
+   free(adj_start);
+   free(x);
+   free(nodes);
+
+   return(iter+1);
 }
 
 
@@ -115,20 +374,33 @@ int three_d_laplace(tri_pointer tri_head,int num_cycles) {
  * smooth the nodes; ref Tryggvason, JCP 169 (2) p708.
  *
  * apply one second's worth of surface tension with the given coefficient
+ *
+ * Each edge of each triangle pulls on both of its end nodes; rather
+ * than scatter those forces through the triangles, every node gathers
+ * them from its own connected triangles, so nodes run in parallel.
  */
 int three_d_surface_tension(tri_pointer tri_head,double coeff) {
 
-   int i,j;//,index;
-   //int num = 0;
+   int i,n;
    int num_cycles = 10;
-   VEC force,tri_norm,oneedge;
-   node_ptr curr_node;
-   node_ptr startn,endn;
+   int num_tris = 0;
+   VEC *pos,*newpos,*temp,*tri_norm;
+   node_ptr *nodes;
    tri_pointer curr_tri;
+   tri_pointer *tris;
 
    // if coefficient is too high, increase the number of cycles
    // if (coeff > 0.1) num_cycles = 2+(int)(coeff*10.);
 
+   const int num_nodes = gather_smooth_nodes(&nodes,&pos);
+   newpos = pos + num_nodes;
+   for (curr_tri=tri_head; curr_tri; curr_tri=curr_tri->next_tri)
+      curr_tri->index = num_tris++;
+   tris = (tri_pointer*) malloc((num_tris+1)*sizeof(tri_pointer));
+   tri_norm = (VEC*) malloc((num_tris+1)*sizeof(VEC));
+   for (curr_tri=tri_head; curr_tri; curr_tri=curr_tri->next_tri)
+      tris[curr_tri->index] = curr_tri;
+
    /* Loop this routine a number of times */
    if (num_cycles > 0) fprintf(stderr,"Smoothing surface");
    for (i=0; i<num_cycles; i++) {
@@ -136,66 +408,389 @@ int three_d_surface_tension(tri_pointer tri_head,double coeff) {
       fprintf(stderr,".");
       fflush(stderr);
 
-      /* save all current node locations in the temp_node_record */
-      curr_node = node_head;
-      while (curr_node) {
-         curr_node->temp_loc.x = curr_node->loc.x;
-         curr_node->temp_loc.y = curr_node->loc.y;
-         curr_node->temp_loc.z = curr_node->loc.z;
-         curr_node = curr_node->next_node;
+      // the triangle norm (make it the unit-length negative norm!)
+      #pragma omp parallel for schedule(static)
+      for (n=0; n<num_tris; n++) {
+         const VEC p0 = pos[tris[n]->node[0]->index];
+         const VEC p1 = pos[tris[n]->node[1]->index];
+         const VEC p2 = pos[tris[n]->node[2]->index];
+         tri_norm[n] = norm(cross(from(p0,p1),from(p2,p1)));
       }
 
       /* move all nodes a short distance, based on the location
        * of its neighbor nodes */
-      curr_tri = tri_head;
-      while (curr_tri) {
+      #pragma omp parallel for schedule(static)
+      for (n=0; n<num_nodes; n++) {
+         const node_ptr this_node = nodes[n];
+         VEC sum = pos[n];
+         int j;
+         for (j=0; j<this_node->num_conn; j++) {
+            const tri_pointer this_tri = this_node->conn_tri[j];
+            const int k = this_node->conn_tri_node[j];
+            const VEC here = pos[n];
+            const VEC next = pos[this_tri->node[(k+1)%3]->index];
+            const VEC prev = pos[this_tri->node[(k+2)%3]->index];
+            VEC force;
+
+            // force is coefficient times edge cross normal, and the
+            // same force goes on both end nodes of the edge; this
+            // node ends the edge from prev and starts the one to next
+            force = cross(from(prev,here),tri_norm[this_tri->index]);
+            force = vscale(0.5*coeff/num_cycles,force);
+            sum.x += force.x;
+            sum.y += force.y;
+            sum.z += force.z;
+            force = cross(from(here,next),tri_norm[this_tri->index]);
+            force = vscale(0.5*coeff/num_cycles,force);
+            sum.x += force.x;
+            sum.y += force.y;
+            sum.z += force.z;
+         }
+         newpos[n] = sum;
+      }
 
-         // the triangle norm (make it the unit-length negative norm!)
-         tri_norm = norm(cross(from(curr_tri->node[0]->loc,curr_tri->node[1]->loc),from(curr_tri->node[2]->loc,curr_tri->node[1]->loc)));
-         // tri_norm = cross(from(curr_tri->node[0]->loc,curr_tri->node[1]->loc),from(curr_tri->node[2]->loc,curr_tri->node[1]->loc));
+      temp = pos;
+      pos = newpos;
+      newpos = temp;
+   }
+   if (num_cycles > 0) fprintf(stderr,"\n");
 
-         // for each edge
-         for (j=0;j<3;j++) {
+   /* apply the new locations to the nodes */
+   for (n=0; n<num_nodes; n++) nodes[n]->loc = pos[n];
 
-            startn = curr_tri->node[j];
-            endn = curr_tri->node[(j+1)%3];
-            oneedge = from(startn->loc,endn->loc);
-            // oneedge = norm(from(startn->loc,endn->loc));
+   free(tri_norm);
+   free(tris);
+   free(pos < newpos ? pos : newpos);
+   free(nodes);
 
-            // force is coefficient times edge cross normal
-            force = vscale(0.5*coeff/num_cycles,cross(oneedge,tri_norm));
+   /* return some metric */
+   return(0);
+}
 
-            // half of the force goes on each end node
 
-            // fprintf(stderr,"   node x=%g",curr_node->loc.x); fflush(stderr);
-            startn->temp_loc.x += force.x;
-            startn->temp_loc.y += force.y;
-            startn->temp_loc.z += force.z;
-            endn->temp_loc.x += force.x;
-            endn->temp_loc.y += force.y;
-            endn->temp_loc.z += force.z;
-            // fprintf(stderr," to x=%g\n",curr_node->loc.x); fflush(stderr);
+/*
+ * Smooth the surface while keeping its sharp features (bilateral
+ * normal filtering, Zheng et al., IEEE TVCG 2011)
+ *
+ * First the face normals are smoothed: each becomes the area-weighted
+ * mean of the normals of the faces sharing a node with it, where faces
+ * farther away or with a normal more than about sigma_n different
+ * count for less, so creases and ridges survive. Then the nodes are
+ * moved so that the faces around them line up with the new normals.
+ * Faces and nodes run in parallel, reading only the last pass's values.
+ */
+int bilateral_normal_filter(tri_pointer tri_head,int num_iters,double sigma_n) {
+
+   int i,n;
+   int num_tris = 0;
+   int num_vert_iters = 10;
+   long num_pairs = 0;
+   long *nbr_start;
+   int *nbr,*nbr_num;
+   int *corner,*node_tri,*node_tri_start;
+   double sigma_s = 0.;
+   double *area;
+   VEC *pos,*newpos,*temp;
+   VEC *tri_norm,*new_norm,*cent;
+   node_ptr *nodes;
+   tri_pointer curr_tri;
+   tri_pointer *tris;
+
+   const int num_nodes = gather_smooth_nodes(&nodes,&pos);
+   newpos = pos + num_nodes;
+   for (curr_tri=tri_head; curr_tri; curr_tri=curr_tri->next_tri)
+      curr_tri->index = num_tris++;
+   tris = (tri_pointer*) malloc((num_tris+1)*sizeof(tri_pointer));
+   tri_norm = (VEC*) malloc((2*num_tris+1)*sizeof(VEC));
+   cent = (VEC*) malloc((num_tris+1)*sizeof(VEC));
+   area = (double*) malloc((num_tris+1)*sizeof(double));
+   nbr_start = (long*) malloc((num_tris+1)*sizeof(long));
+   nbr_num = (int*) malloc((num_tris+1)*sizeof(int));
+   if (!tris || !tri_norm || !cent || !area || !nbr_start || !nbr_num) {
+      fprintf(stderr,"Could not allocate filtering arrays for %d tris.\n",num_tris);
+      exit(1);
+   }
+   new_norm = tri_norm + num_tris;
+   for (curr_tri=tri_head; curr_tri; curr_tri=curr_tri->next_tri)
+      tris[curr_tri->index] = curr_tri;
+
+   // the nodes of tri n are corner[3*n..3*n+2], and the tris using
+   // node n are node_tri[node_tri_start[n]..node_tri_start[n+1]-1]
+   corner = (int*) malloc((3*(long)num_tris+1)*sizeof(int));
+   node_tri_start = (int*) malloc((num_nodes+1)*sizeof(int));
+   node_tri_start[0] = 0;
+   for (n=0; n<num_nodes; n++)
+      node_tri_start[n+1] = node_tri_start[n] + nodes[n]->num_conn;
+   node_tri = (int*) malloc((node_tri_start[num_nodes]+1)*sizeof(int));
+   if (!corner || !node_tri_start || !node_tri) {
+      fprintf(stderr,"Could not allocate filtering arrays for %d nodes.\n",num_nodes);
+      exit(1);
+   }
+   #pragma omp parallel for private(i) schedule(static)
+   for (n=0; n<num_tris; n++)
+      for (i=0; i<3; i++) corner[3*(long)n+i] = tris[n]->node[i]->index;
+   #pragma omp parallel for private(i) schedule(static)
+   for (n=0; n<num_nodes; n++)
+      for (i=0; i<nodes[n]->num_conn; i++)
+         node_tri[node_tri_start[n]+i] = nodes[n]->conn_tri[i]->index;
+
+   // the faces sharing a node with face n, without repeats, are
+   // nbr[nbr_start[n]..nbr_start[n]+nbr_num[n]-1]
+   nbr_start[0] = 0;
+   for (n=0; n<num_tris; n++)
+      nbr_start[n+1] = nbr_start[n] + tris[n]->node[0]->num_conn
+                     + tris[n]->node[1]->num_conn + tris[n]->node[2]->num_conn;
+   nbr = (int*) malloc((nbr_start[num_tris]+1)*sizeof(int));
+   if (!nbr) {
+      fprintf(stderr,"Could not allocate face neighbors for %d tris.\n",num_tris);
+      exit(1);
+   }
+   #pragma omp parallel for private(i) schedule(static)
+   for (n=0; n<num_tris; n++) {
+      int *list = nbr + nbr_start[n];
+      int cnt = 0;
+      for (i=0; i<3; i++) {
+         const node_ptr this_node = tris[n]->node[i];
+         int j,k;
+         for (j=0; j<this_node->num_conn; j++) {
+            const int t = this_node->conn_tri[j]->index;
+            if (t == n) continue;
+            for (k=0; k<cnt; k++) if (list[k] == t) break;
+            if (k == cnt) list[cnt++] = t;
          }
+      }
+      nbr_num[n] = cnt;
+   }
 
-         curr_tri = curr_tri->next_tri;
+   // the face normals, areas and centroids from the current nodes
+   #pragma omp parallel for schedule(static)
+   for (n=0; n<num_tris; n++) {
+      const VEC p0 = pos[corner[3*(long)n]];
+      const VEC p1 = pos[corner[3*(long)n+1]];
+      const VEC p2 = pos[corner[3*(long)n+2]];
+      const VEC c = cross(from(p0,p1),from(p0,p2));
+      const double len = length(c);
+      area[n] = 0.5*len;
+      // degenerate faces get a zero normal and do not take part
+      tri_norm[n] = (len > 0.) ? vscale(1./len,c) : vscale(0.,c);
+      cent[n].x = (p0.x+p1.x+p2.x)/3.;
+      cent[n].y = (p0.y+p1.y+p2.y)/3.;
+      cent[n].z = (p0.z+p1.z+p2.z)/3.;
+   }
+
+   // the spatial width is the mean distance between neighboring faces
+   #pragma omp parallel for private(i) schedule(static) reduction(+:sigma_s,num_pairs)
+   for (n=0; n<num_tris; n++) {
+      for (i=0; i<nbr_num[n]; i++)
+         sigma_s += length(from(cent[n],cent[nbr[nbr_start[n]+i]]));
+      num_pairs += nbr_num[n];
+   }
+   if (num_pairs > 0) sigma_s /= num_pairs;
+   if (!(sigma_s > 0.)) sigma_s = 1.;
+
+   /* Filter the face normals a number of times */
+   if (num_iters > 0) fprintf(stderr,"Filtering normals");
+   for (i=0; i<num_iters; i++) {
+
+      fprintf(stderr,".");
+      fflush(stderr);
+
+      const double ws = 0.5/(sigma_s*sigma_s);
+      const double wn = 0.5/(sigma_n*sigma_n);
+
+      #pragma omp parallel for schedule(static)
+      for (n=0; n<num_tris; n++) {
+         const VEC this_norm = tri_norm[n];
+         VEC sum = vscale(area[n],this_norm);
+         double len;
+         int j;
+         for (j=0; j<nbr_num[n]; j++) {
+            const int t = nbr[nbr_start[n]+j];
+            const double ds = lengthsq(from(cent[n],cent[t]));
+            const double dn = lengthsq(from(this_norm,tri_norm[t]));
+            const double w = area[t] * exp(-ds*ws - dn*wn);
+            sum.x += w*tri_norm[t].x;
+            sum.y += w*tri_norm[t].y;
+            sum.z += w*tri_norm[t].z;
+         }
+         len = length(sum);
+         new_norm[n] = (len > 0.) ? vscale(1./len,sum) : this_norm;
       }
 
-      /* apply the new locations to the nodes */
-      curr_node = node_head;
-      while (curr_node) {
-         curr_node->loc.x = curr_node->temp_loc.x;
-         curr_node->loc.y = curr_node->temp_loc.y;
-         curr_node->loc.z = curr_node->temp_loc.z;
-         curr_node = curr_node->next_node;
+      temp = tri_norm;
+      tri_norm = new_norm;
+      new_norm = temp;
+   }
+   if (num_iters > 0) fprintf(stderr,"\n");
+
+   /* Move each node so that its faces lie normal to the filtered normals */
+   if (num_iters > 0) fprintf(stderr,"Fitting nodes");
+   for (i=0; i<num_vert_iters && num_iters>0; i++) {
+
+      fprintf(stderr,".");
+      fflush(stderr);
+
+      #pragma omp parallel for schedule(static)
+      for (n=0; n<num_tris; n++) {
+         const VEC p0 = pos[corner[3*(long)n]];
+         const VEC p1 = pos[corner[3*(long)n+1]];
+         const VEC p2 = pos[corner[3*(long)n+2]];
+         cent[n].x = (p0.x+p1.x+p2.x)/3.;
+         cent[n].y = (p0.y+p1.y+p2.y)/3.;
+         cent[n].z = (p0.z+p1.z+p2.z)/3.;
+      }
+
+      #pragma omp parallel for schedule(static)
+      for (n=0; n<num_nodes; n++) {
+         const int first = node_tri_start[n];
+         const int num_conn = node_tri_start[n+1] - first;
+         VEC sum = pos[n];
+         int j;
+         for (j=0; j<num_conn; j++) {
+            const int t = node_tri[first+j];
+            const double d = dot(tri_norm[t],from(pos[n],cent[t])) / num_conn;
+            sum.x += d*tri_norm[t].x;
+            sum.y += d*tri_norm[t].y;
+            sum.z += d*tri_norm[t].z;
+         }
+         newpos[n] = sum;
       }
+
+      temp = pos;
+      pos = newpos;
+      newpos = temp;
    }
-   if (num_cycles > 0) fprintf(stderr,"\n");
+   if (num_iters > 0) fprintf(stderr,"\n");
+
+   /* apply the new locations to the nodes */
+   for (n=0; n<num_nodes; n++) nodes[n]->loc = pos[n];
+
+   free(nbr);
+   free(nbr_num);
+   free(node_tri);
+   free(node_tri_start);
+   free(corner);
+   free(nbr_start);
+   free(area);
+   free(cent);
+   free(tri_norm < new_norm ? tri_norm : new_norm);
+   free(tris);
+   free(pos < newpos ? pos : newpos);
+   free(nodes);
 
    /* return some metric */
    return(0);
 }
 
 
+// the NORM records made by the normal routines below come from one
+// block, rather than from one malloc each
+static NORM *norm_block = NULL;
+static long norm_block_len = 0;
+
+// free all normals on norm_head, and unhook them from the triangles
+static void clear_normals(tri_pointer tri_head) {
+
+   norm_ptr curr_norm = norm_head;
+   tri_pointer test_tri;
+
+   // this is dangerous and ugly, smart pointers would be better
+   while (curr_norm) {
+      norm_ptr temp_norm = curr_norm->next_norm;
+      if (!norm_block || curr_norm < norm_block || curr_norm >= norm_block+norm_block_len)
+         free(curr_norm);
+      curr_norm = temp_norm;
+   }
+   free(norm_block);
+   norm_block = NULL;
+   norm_block_len = 0;
+   norm_head = NULL;
+
+   for (test_tri=tri_head; test_tri; test_tri=test_tri->next_tri)
+      for (int i=0; i<3; i++) test_tri->norm[i] = NULL;
+}
+
+// make count normal records in one block, linked in order as norm_head
+static NORM* alloc_normals(long count) {
+
+   long i;
+
+   norm_block = (NORM*) malloc((count+1)*sizeof(NORM));
+   if (!norm_block) {
+      fprintf(stderr,"Could not allocate %ld normals.\n",count);
+      exit(1);
+   }
+   norm_block_len = count;
+   #pragma omp parallel for schedule(static)
+   for (i=0; i<count; i++) {
+      norm_block[i].index = i;
+      norm_block[i].next_bnorm = NULL;
+      norm_block[i].next_norm = (i+1 < count) ? &norm_block[i+1] : NULL;
+   }
+   norm_head = (count > 0) ? norm_block : NULL;
+
+   return norm_block;
+}
+
+// the unit normal of a triangle connected to a node, and its weight
+// in that node's normal, for the methods below; corner is the node's
+// place in the triangle
+static inline double corner_normal(tri_pointer test_tri, int corner,
+                                   int method, VEC *tri_norm) {
+
+   double weight;
+   VEC e1,e2;
+
+   if (method == 2) {
+      // norm can use any nodes
+      e1 = from(test_tri->node[0]->loc,test_tri->node[1]->loc);
+      e2 = from(test_tri->node[0]->loc,test_tri->node[2]->loc);
+      *tri_norm = cross(e1,e2);
+      // weight based on area of tri
+      weight = 0.5*length(*tri_norm);
+      // must normalize *after* finding area
+      *tri_norm = norm(*tri_norm);
+   } else if (method == 3) {
+      // norm must use vectors from key node
+      e1 = from(test_tri->node[corner]->loc,test_tri->node[(corner+1)%3]->loc);
+      e2 = from(test_tri->node[corner]->loc,test_tri->node[(corner+2)%3]->loc);
+      *tri_norm = norm(cross(e1,e2));
+      // weight based on angle swept by tri from given node
+      weight = acos(dot(e1,e2)/sqrt(lengthsq(e1)*lengthsq(e2)));
+   } else {
+      // all tris weighted evenly
+      weight = 1.;
+      // must normalize normal vector nonetheless
+      e1 = from(test_tri->node[0]->loc,test_tri->node[1]->loc);
+      e2 = from(test_tri->node[0]->loc,test_tri->node[2]->loc);
+      *tri_norm = norm(cross(e1,e2));
+   }
+
+   return weight;
+}
+
+// all nodes in list order, leaving node->index alone
+static node_ptr* gather_node_array(int *num) {
+
+   int n = 0;
+   node_ptr curr_node;
+   node_ptr *nodes;
+
+   for (curr_node=node_head; curr_node; curr_node=curr_node->next_node) n++;
+   nodes = (node_ptr*) malloc((n+1)*sizeof(node_ptr));
+   if (!nodes) {
+      fprintf(stderr,"Could not allocate node array for %d nodes.\n",n);
+      exit(1);
+   }
+   n = 0;
+   for (curr_node=node_head; curr_node; curr_node=curr_node->next_node)
+      nodes[n++] = curr_node;
+
+   *num = n;
+   return nodes;
+}
+
+
 /*
  * Find the normal vectors of the nodes by averaging the normals
  * of ALL connecting triangles.
@@ -203,88 +798,41 @@ int three_d_surface_tension(tri_pointer tri_head,double coeff) {
  * method 1 uses the mean of the normals of all adjacent elements
  * method 2 uses the area-weighted normals of adj elems
  * method 3 uses the angle-weighted normals of adj elems
+ *
+ * Each node finds its own normal from its connected triangles, so
+ * nodes run in parallel, and gets one normal record in a shared block.
  */
 int compute_normals_2 (tri_pointer tri_head, int method) {
 
-   int index,j;
-   int num_norms = 0;
-   double weight;
-   VEC sum,tri_norm;
-   VEC e1,e2;
-   node_ptr curr_node;
-   tri_pointer test_tri;
+   int n;
+   int num_nodes;
+   node_ptr *nodes;
+   NORM *norms;
 
    fprintf(stderr,"Computing normal vectors.");
    fflush(stderr);
 
-   // first, remove all old normals - this is dangerous and ugly
-   // smart pointers would be better
-   norm_ptr curr_norm = norm_head;
-   while (curr_norm) {
-      norm_ptr temp_norm = curr_norm->next_norm;
-      free(curr_norm);
-      curr_norm = temp_norm;
-   }
-   norm_head = NULL;
-
-   test_tri = tri_head;
-   while (test_tri) {
-      for (int i=0; i<3; i++) test_tri->norm[i] = NULL;
-      test_tri = test_tri->next_tri;
-   }
-
+   // first, remove all old normals
+   (void) clear_normals(tri_head);
 
    // now, compute new normals
-   NBIN normbin;
-   (void) prepare_norm_bin (&normbin);
+   nodes = gather_node_array(&num_nodes);
+   norms = alloc_normals(num_nodes);
 
-   curr_node = node_head;
-   while (curr_node) {
-      //fprintf(stderr,"\nnode %d\n",curr_node->index); fflush(stderr);
-      //fprintf(stderr,"  num_conn %d\n",curr_node->num_conn); fflush(stderr);
-      //for (j=0; j<curr_node->num_conn; j++) {
-      //   fprintf(stderr,"  tri %d\n",curr_node->conn_tri[j]->index); fflush(stderr);
-      //   for (i=0; i<3; i++) fprintf(stderr,"    node %d\n",curr_node->conn_tri[j]->node[i]->index); fflush(stderr);
-      //}
+   #pragma omp parallel for schedule(static)
+   for (n=0; n<num_nodes; n++) {
+      const node_ptr curr_node = nodes[n];
+      double weight;
+      VEC sum,tri_norm;
+      int j;
 
       // loop over all connected triangles, find normal as average
       sum.x = 0;
       sum.y = 0;
       sum.z = 0;
-      weight = 0.;
       for (j=0; j<curr_node->num_conn; j++) {
-         test_tri = curr_node->conn_tri[j];
-         //fprintf(stderr,"  tri %d\n",test_tri->index); fflush(stderr);
-         //fprintf(stderr,"  nodes %d %d %d\n",test_tri->node[0]->index,test_tri->node[1]->index,test_tri->node[2]->index); fflush(stderr);
-         //for (i=0; i<3; i++) fprintf(stderr,"  %d  %g %g %g\n",i,test_tri->node[i]->loc.x,test_tri->node[i]->loc.y,test_tri->node[i]->loc.z); fflush(stderr);
-         if (method == 2) {
-           // norm can use any nodes
-           e1 = from(test_tri->node[0]->loc,test_tri->node[1]->loc);
-           e2 = from(test_tri->node[0]->loc,test_tri->node[2]->loc);
-           tri_norm = cross(e1,e2);
-           // weight based on area of tri
-           weight = 0.5*length(tri_norm);
-           // must normalize *after* finding area
-           tri_norm = norm(tri_norm);
-         } else if (method == 3) {
-           // norm must use vectors from key node
-           index = curr_node->conn_tri_node[j];
-           e1 = from(test_tri->node[index]->loc,test_tri->node[(index+1)%3]->loc);
-           e2 = from(test_tri->node[index]->loc,test_tri->node[(index+2)%3]->loc);
-           tri_norm = cross(e1,e2);
-           tri_norm = norm(tri_norm);
-           // weight based on angle swept by tri from given node
-           weight = acos(dot(e1,e2)/sqrt(lengthsq(e1)*lengthsq(e2)));
-           //fprintf(stderr,"  %d wt %g  e1,e2 %g %g  norm %g %g %g\n",j,weight,lengthsq(e1),lengthsq(e2),tri_norm.x,tri_norm.y,tri_norm.z);
-         } else {
-           // all tris weighted evenly
-           weight = 1.;
-           // must normalize normal vector nonetheless
-           e1 = from(test_tri->node[0]->loc,test_tri->node[1]->loc);
-           e2 = from(test_tri->node[0]->loc,test_tri->node[2]->loc);
-           tri_norm = cross(e1,e2);
-           tri_norm = norm(tri_norm);
-         }
+         weight = corner_normal(curr_node->conn_tri[j],
+                                curr_node->conn_tri_node[j], method, &tri_norm);
          if (!isnan(tri_norm.x)) {
            if (weight == 0.) weight = 1.e-6;
            sum.x += tri_norm.x*weight;
@@ -295,28 +843,20 @@ int compute_normals_2 (tri_pointer tri_head, int method) {
 
       sum = norm(sum);
       if (isnan(sum.x) || fabs(sum.x+sum.y+sum.z) < 1.e-6) {
-         //fprintf(stderr,"node %d\n",curr_node->index);
-         //fprintf(stderr,"  weight %g\n",weight);
-         //fprintf(stderr,"  norm %g %g %g\n",sum.x,sum.y,sum.z);
          sum.x = 0.;
          sum.y = 0.;
          sum.z = 1.;
       }
-
-      // make a new normal object
-      norm_ptr new_norm = add_to_norms_list(&num_norms,&sum,&normbin);
+      norms[n].norm = sum;
 
       // loop over all connected triangles, save normal as norm[]
-      for (j=0; j<curr_node->num_conn; j++) {
-         test_tri = curr_node->conn_tri[j];
-         index = curr_node->conn_tri_node[j];
-         test_tri->norm[index] = new_norm;
-      }
-
-      curr_node = curr_node->next_node;
+      for (j=0; j<curr_node->num_conn; j++)
+         curr_node->conn_tri[j]->norm[curr_node->conn_tri_node[j]] = &norms[n];
    }
    fprintf(stderr,"\n");
 
+   free(nodes);
+
    return(0);
 }
 
@@ -330,225 +870,212 @@ int compute_normals_2 (tri_pointer tri_head, int method) {
  * method 2 uses the area-weighted normals of adj elems
  * method 3 uses the angle-weighted normals of adj elems
  *
- * this method is a copy of compute_normals_2
+ * Each triangle's normal and its weights at its three corners are
+ * found once, then the normal at every corner of every triangle is
+ * gathered in parallel into one array, three per triangle; the corners
+ * at each node that came out the same share one record in a block.
  */
 int compute_normals_3 (tri_pointer tri_head, int method, int use_sharp, double sharp_thresh) {
 
-   int index,i,j,icnt,newj;
-   double weight,thresh;
-   VEC sum,tri_norm,this_norm;
-   VEC e1,e2;
+   int i,j,n;
+   int num_tris = 0;
+   int num_nodes;
+   int num_bad = 0;
+   long num_norms;
+   long *norm_start;
+   double thresh;
+   VEC *face_norm;
+   VEC *corner_norm;
+   double *face_wgt;
    node_ptr curr_node;
+   node_ptr *nodes;
    tri_pointer curr_tri,test_tri,last_tri;
-
-   // before messing with anything, remove all old normals - this is dangerous and ugly
-   norm_ptr curr_norm = norm_head;
-   while (curr_norm) {
-      norm_ptr temp_norm = curr_norm->next_norm;
-      free(curr_norm);
-      curr_norm = temp_norm;
+   tri_pointer *tris;
+   NORM *norms;
+
+   // before messing with anything, remove all old normals
+   (void) clear_normals(tri_head);
+
+   // gather the tris and find each one's normal
+   for (curr_tri=tri_head; curr_tri; curr_tri=curr_tri->next_tri) num_tris++;
+   tris = (tri_pointer*) malloc((num_tris+1)*sizeof(tri_pointer));
+   face_norm = (VEC*) malloc((num_tris+1)*sizeof(VEC));
+   corner_norm = (VEC*) malloc((3*(long)num_tris+1)*sizeof(VEC));
+   face_wgt = (double*) malloc((3*(long)num_tris+1)*sizeof(double));
+   if (!tris || !face_norm || !corner_norm || !face_wgt) {
+      fprintf(stderr,"Could not allocate normal arrays for %d tris.\n",num_tris);
+      exit(1);
+   }
+   num_tris = 0;
+   for (curr_tri=tri_head; curr_tri; curr_tri=curr_tri->next_tri) {
+      curr_tri->index = num_tris;
+      tris[num_tris++] = curr_tri;
    }
-   norm_head = NULL;
 
-   test_tri = tri_head;
-   while (test_tri) {
-      for (int i=0; i<3; i++) test_tri->norm[i] = NULL;
-      test_tri = test_tri->next_tri;
+   #pragma omp parallel for schedule(static) reduction(+:num_bad)
+   for (n=0; n<num_tris; n++) {
+      const tri_pointer this_tri = tris[n];
+      face_norm[n] = norm(cross(from(this_tri->node[0]->loc,this_tri->node[1]->loc),
+                                from(this_tri->node[0]->loc,this_tri->node[2]->loc)));
+      if (!(face_norm[n].x < 2. && face_norm[n].x > -2)) num_bad++;
    }
 
    // ----------------------------------------------------------------
    // first step, make sure all triangles have real area,
    // and not "nan" for a normal!
 
-   fprintf(stderr,"Checking for degenerate tris.");
-   fflush(stderr);
+   if (num_bad > 0) {
+      fprintf(stderr,"Removing %d degenerate tris.\n",num_bad);
 
-   icnt = 0;
-   last_tri = NULL;
-   curr_tri = tri_head;
-   while (curr_tri) {
-
-     // find the normal of this tri
-     e1 = from(curr_tri->node[0]->loc,curr_tri->node[1]->loc);
-     e2 = from(curr_tri->node[0]->loc,curr_tri->node[2]->loc);
-     this_norm = cross(e1,e2);
-     this_norm = norm(this_norm);
-
-     // if the normal for this tri is bad, then throw away the triangle!
-     // Whoah, that would affect connectivity! Shit.
-     // But we have to, or else this bad tri will mess up other tris!
-     if (this_norm.x < 2. && this_norm.x > -2) {
-
-       // if true, then this is a good tri! go on to the next.
-       last_tri = curr_tri;
-       curr_tri = curr_tri->next_tri;
-
-     } else {
-
-       // it's a bad tri, remove it CAREFULLY!
-       //fprintf(stderr,"\ntri %d IS BAD\n",curr_tri->index);
-       //fprintf(stderr,"  norm %g %g %g\n",this_norm.x,this_norm.y,this_norm.z);
-       //fprintf(stderr,"  nodes %d %d %d\n",curr_tri->node[0]->index,curr_tri->node[1]->index,curr_tri->node[2]->index);
-
-       // remove the tri from the connectivity list for each node
-       for (i=0; i<3; i++) {
-         curr_node = curr_tri->node[i];
-         //fprintf(stderr,"  node %d has %d connecting tris\n",i,curr_node->num_conn);
-         // loop through the list, compacting it as you go
-         newj = 0;
-         for (j=0; j<curr_node->num_conn; j++) {
-           if (curr_node->conn_tri[j] != curr_tri) {
-             curr_node->conn_tri[newj] = curr_node->conn_tri[j];
-             curr_node->conn_tri_node[newj] = curr_node->conn_tri_node[j];
-             newj++;
-           }
+      // if the normal for this tri is bad, then throw away the triangle!
+      // Whoah, that would affect connectivity! Shit.
+      // But we have to, or else this bad tri will mess up other tris!
+      last_tri = NULL;
+      curr_tri = tri_head;
+      while (curr_tri) {
+         n = curr_tri->index;
+         if ((face_norm[n].x < 2. && face_norm[n].x > -2) || !last_tri) {
+            // if true, then this is a good tri (or the head, which
+            // we cannot unlink from here); go on to the next.
+            last_tri = curr_tri;
+            curr_tri = curr_tri->next_tri;
+            continue;
          }
-         // change num_conn as well
-         curr_node->num_conn = newj;
-         //fprintf(stderr,"      now has %d\n",curr_node->num_conn);
-       }
 
-       // now, remove the triangle from the linked list!
-       test_tri = curr_tri;
-       curr_tri = curr_tri->next_tri;
-       free(test_tri);
-       last_tri->next_tri = curr_tri;
-       // keep last_tri unchanged
-     }
+         // remove the tri from the connectivity list for each node
+         for (i=0; i<3; i++) {
+            curr_node = curr_tri->node[i];
+            int newj = 0;
+            for (j=0; j<curr_node->num_conn; j++) {
+               if (curr_node->conn_tri[j] != curr_tri) {
+                  curr_node->conn_tri[newj] = curr_node->conn_tri[j];
+                  curr_node->conn_tri_node[newj] = curr_node->conn_tri_node[j];
+                  newj++;
+               }
+            }
+            curr_node->num_conn = newj;
+         }
 
+         // and remove it from the list of tris
+         test_tri = curr_tri;
+         curr_tri = curr_tri->next_tri;
+         free(test_tri);
+         last_tri->next_tri = curr_tri;
+      }
 
-     if (icnt/DOTPER == (icnt+DPMO)/DOTPER) fprintf(stderr,".");
-     icnt++;
+      num_tris = 0;
+      for (curr_tri=tri_head; curr_tri; curr_tri=curr_tri->next_tri) {
+         face_norm[num_tris] = face_norm[curr_tri->index];
+         curr_tri->index = num_tris;
+         tris[num_tris++] = curr_tri;
+      }
    }
-   fprintf(stderr,"\n");
 
-   // ----------------------------------------------------------------
    fprintf(stderr,"Computing normal vectors.");
    fflush(stderr);
 
-   // prepare node binning structure
-   NBIN normbin;
-   (void) prepare_norm_bin (&normbin);
-   int num_norms = 0;
-
    // convert threshhold in degrees to a dot product threshhold
    thresh = cos(sharp_thresh*M_PI/180.);
 
-   icnt = 0;
-   curr_tri = tri_head;
-   while (curr_tri) {
-
-    // find the normal of this tri
-    e1 = from(curr_tri->node[0]->loc,curr_tri->node[1]->loc);
-    e2 = from(curr_tri->node[0]->loc,curr_tri->node[2]->loc);
-    this_norm = cross(e1,e2);
-    this_norm = norm(this_norm);
-
-    // loop over each node in this tri
-    for (i=0; i<3; i++) {
+   // each tri's weight in the normal at each of its corners
+   #pragma omp parallel for schedule(static)
+   for (n=0; n<num_tris; n++) {
+      VEC tri_norm;
+      int c;
+      for (c=0; c<3; c++)
+         face_wgt[3*(long)n+c] = corner_normal(tris[n], c, method, &tri_norm);
+   }
 
-      curr_node = curr_tri->node[i];
+   // find the normal at each corner of each tri
+   #pragma omp parallel for schedule(static)
+   for (n=0; n<num_tris; n++) {
+      const tri_pointer this_tri = tris[n];
+      const VEC this_norm = face_norm[n];
+      int c,k;
+
+      for (c=0; c<3; c++) {
+         const node_ptr this_node = this_tri->node[c];
+         double weight;
+         VEC sum,tri_norm;
+
+         // loop over all connected triangles, find normal as average
+         sum.x = 0;
+         sum.y = 0;
+         sum.z = 0;
+         for (k=0; k<this_node->num_conn; k++) {
+            const int t = this_node->conn_tri[k]->index;
+            weight = face_wgt[3*(long)t + this_node->conn_tri_node[k]];
+            tri_norm = face_norm[t];
+            // is the normal of the test tri significantly different from this_tri?
+            if (use_sharp && dot(this_norm,tri_norm) < thresh) weight = 0.;
+            sum.x += tri_norm.x*weight;
+            sum.y += tri_norm.y*weight;
+            sum.z += tri_norm.z*weight;
+         }
+         sum = norm(sum);
 
-      //fprintf(stderr,"\nnode %d\n",curr_node->index);
-      //fprintf(stderr,"  norm %g %g %g\n",this_norm.x,this_norm.y,this_norm.z);
-      //fprintf(stderr,"  node %g %g %g\n",curr_node->loc.x,curr_node->loc.y,curr_node->loc.z);
-      //fprintf(stderr,"  num_conn %d\n",curr_node->num_conn); fflush(stderr);
-      //for (j=0; j<curr_node->num_conn; j++) {
-      //   fprintf(stderr,"  tri %d\n",curr_node->conn_tri[j]->index); fflush(stderr);
-         // for (i=0; i<3; i++) fprintf(stderr,"    node %d\n",curr_node->conn_tri[j]->node[i]->index); fflush(stderr);
-      //}
+         // check for inconclusive normals and assign triangle normal
+         if (!(sum.x < 2. && sum.x > -2)) sum = this_norm;
 
-      // loop over all connected triangles, find normal as average
-      sum.x = 0;
-      sum.y = 0;
-      sum.z = 0;
-      weight = 0.;
-      for (j=0; j<curr_node->num_conn; j++) {
+         corner_norm[3*(long)n+c] = sum;
+      }
+   }
 
-         test_tri = curr_node->conn_tri[j];
-         if (method == 2) {
-           // norm can use any nodes
-           e1 = from(test_tri->node[0]->loc,test_tri->node[1]->loc);
-           e2 = from(test_tri->node[0]->loc,test_tri->node[2]->loc);
-           tri_norm = cross(e1,e2);
-           // weight based on area of tri
-           weight = 0.5*length(tri_norm);
-           // must normalize *after* finding area
-           tri_norm = norm(tri_norm);
-
-         } else if (method == 3) {
-           // norm must use vectors from key node
-           index = curr_node->conn_tri_node[j];
-           //fprintf(stderr,"  node %d\n",test_tri->node[index]->index);
-           //if (curr_node != test_tri->node[index]) fprintf(stderr,"  whoops");
-           e1 = from(test_tri->node[index]->loc,test_tri->node[(index+1)%3]->loc);
-           e2 = from(test_tri->node[index]->loc,test_tri->node[(index+2)%3]->loc);
-           tri_norm = cross(e1,e2);
-           tri_norm = norm(tri_norm);
-           // weight based on angle swept by tri from given node
-           weight = acos(dot(e1,e2)/sqrt(lengthsq(e1)*lengthsq(e2)));
-           //if (weight < 0. || weight > 3.15) {
-           //fprintf(stderr,"  %d wt %g norm %g %g %g\n",j,weight,tri_norm.x,tri_norm.y,tri_norm.z);
-           //}
-
-         } else {
-           // all tris weighted evenly
-           weight = 1.;
-           // must normalize normal vector nonetheless
-           e1 = from(test_tri->node[0]->loc,test_tri->node[1]->loc);
-           e2 = from(test_tri->node[0]->loc,test_tri->node[2]->loc);
-           tri_norm = cross(e1,e2);
-           tri_norm = norm(tri_norm);
-         }
-         if (use_sharp) {
-           // check vs threshhold
-           // is the normal of the test tri significantly different from curr_tri?
-           if (dot(this_norm,tri_norm) < thresh) weight = 0.;
-           //fprintf(stderr,"     dotp %g thresh %g\n",dot(this_norm,tri_norm),thresh);
+   // the corners at each node that came out the same share a normal
+   nodes = gather_node_array(&num_nodes);
+   norm_start = (long*) malloc((num_nodes+1)*sizeof(long));
+   #pragma omp parallel for schedule(static)
+   for (n=0; n<num_nodes; n++) {
+      const node_ptr this_node = nodes[n];
+      int k,kk;
+      norm_start[n+1] = 0;
+      for (k=0; k<this_node->num_conn; k++) {
+         const VEC nk = corner_norm[3*(long)this_node->conn_tri[k]->index + this_node->conn_tri_node[k]];
+         for (kk=0; kk<k; kk++) {
+            const VEC nkk = corner_norm[3*(long)this_node->conn_tri[kk]->index + this_node->conn_tri_node[kk]];
+            if (fabs(nk.x-nkk.x) < 1.e-5 && fabs(nk.y-nkk.y) < 1.e-5 && fabs(nk.z-nkk.z) < 1.e-5) break;
          }
-         sum.x += tri_norm.x*weight;
-         sum.y += tri_norm.y*weight;
-         sum.z += tri_norm.z*weight;
+         if (kk == k) norm_start[n+1]++;
       }
-      sum = norm(sum);
-
-      // check for inconclusive normals and assign triangle normal
-      if (!(sum.x < 2. && sum.x > -2)) {
-        fprintf(stderr,"    normal is bad! %g %g %g\n",sum.x,sum.y,sum.z);
-        sum.x = this_norm.x;
-        sum.y = this_norm.y;
-        sum.z = this_norm.z;
+   }
+   norm_start[0] = 0;
+   for (n=0; n<num_nodes; n++) norm_start[n+1] += norm_start[n];
+   num_norms = norm_start[num_nodes];
+   norms = alloc_normals(num_norms);
+
+   #pragma omp parallel for schedule(static)
+   for (n=0; n<num_nodes; n++) {
+      const node_ptr this_node = nodes[n];
+      long next = norm_start[n];
+      int k,kk;
+      for (k=0; k<this_node->num_conn; k++) {
+         const tri_pointer tk = this_node->conn_tri[k];
+         const int ck = this_node->conn_tri_node[k];
+         const VEC nk = corner_norm[3*(long)tk->index + ck];
+         for (kk=0; kk<k; kk++) {
+            const tri_pointer tkk = this_node->conn_tri[kk];
+            const int ckk = this_node->conn_tri_node[kk];
+            const VEC nkk = corner_norm[3*(long)tkk->index + ckk];
+            if (fabs(nk.x-nkk.x) < 1.e-5 && fabs(nk.y-nkk.y) < 1.e-5 && fabs(nk.z-nkk.z) < 1.e-5) {
+               tk->norm[ck] = tkk->norm[ckk];
+               break;
+            }
+         }
+         if (kk == k) {
+            norms[next].norm = nk;
+            tk->norm[ck] = &norms[next++];
+         }
       }
-      //if (!(sum.x < 2. && sum.x > -2)) {
-      //  fprintf(stderr,"    normal is bad again! %g %g %g\n",sum.x,sum.y,sum.z);
-      //  fprintf(stderr,"    %g %g %g\n",curr_tri->node[0]->loc.x,curr_tri->node[0]->loc.y,curr_tri->node[0]->loc.z);
-      //  fprintf(stderr,"    %g %g %g\n",curr_tri->node[1]->loc.x,curr_tri->node[1]->loc.y,curr_tri->node[1]->loc.z);
-      //  fprintf(stderr,"    %g %g %g\n",curr_tri->node[2]->loc.x,curr_tri->node[2]->loc.y,curr_tri->node[2]->loc.z);
-      //}
-
-      // is this normal very different from the tri's normal?
-      //if (dot(this_norm,sum) < thresh) {
-      //  fprintf(stderr,"  tri norm %g %g %g\n",this_norm.x,this_norm.y,this_norm.z);
-      //  fprintf(stderr,"    node norm %g %g %g\n",sum.x,sum.y,sum.z);
-      //  fprintf(stderr,"    dot prod %g\n",dot(this_norm,sum));
-      //}
-      //fprintf(stderr,"  final norm %g %g %g\n",sum.x,sum.y,sum.z);
-
-      // make a new normal object
-      norm_ptr new_norm = add_to_norms_list(&num_norms,&sum,&normbin);
-
-      // save normal
-      curr_tri->norm[i] = new_norm;
-
-    }
-    curr_tri = curr_tri->next_tri;
-
-    if (icnt/DOTPER == (icnt+DPMO)/DOTPER) fprintf(stderr,".");
-    icnt++;
    }
-
    fprintf(stderr,"\n");
 
+   free(norm_start);
+   free(nodes);
+   free(face_wgt);
+   free(corner_norm);
+   free(face_norm);
+   free(tris);
+
    return(0);
 }
 
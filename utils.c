@@ -340,6 +340,9 @@ int add_conn_tri (node_ptr curr_node, tri_pointer the_tri, int index) {
    int *new_conn_tri_node;
 
    if (curr_node->num_conn == curr_node->max_conn || curr_node->max_conn==0) {
+      // a new node's arrays were never allocated, and hold garbage
+      const int had_arrays = (curr_node->max_conn > 0);
+
       // malloc more room in the arrays
       if (curr_node->max_conn == 0) curr_node->max_conn = 1;
       else curr_node->max_conn *= 2;
@@ -348,14 +351,14 @@ int add_conn_tri (node_ptr curr_node, tri_pointer the_tri, int index) {
       new_conn_tri = (tri_pointer*)malloc(curr_node->max_conn*sizeof(tri_pointer));
       for (i=0; i<curr_node->num_conn; i++)
          new_conn_tri[i] = curr_node->conn_tri[i];
-      free(curr_node->conn_tri);
+      if (had_arrays) free(curr_node->conn_tri);
       curr_node->conn_tri = new_conn_tri;
 
       // extend the conn_tri_node array
       new_conn_tri_node = (int*)malloc(curr_node->max_conn*sizeof(int));
       for (i=0; i<curr_node->num_conn; i++)
          new_conn_tri_node[i] = curr_node->conn_tri_node[i];
-      free(curr_node->conn_tri_node);
+      if (had_arrays) free(curr_node->conn_tri_node);
       curr_node->conn_tri_node = new_conn_tri_node;
 
       //fprintf(stderr,"node %d now has array length %d\n",curr_node->index,curr_node->max_conn);
@@ -25,6 +25,7 @@
  *********************************************************** */
 
 
+#define _POSIX_C_SOURCE 200112L	/* for posix_memalign */
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -43,8 +44,17 @@
 /* generate depth-of-field using a slower Gaussian splatting scheme */
 //#define USE_GAUSSIAN
 
-png_byte** allocate_2d_array_pb(int,int,int);
-int write_png_image(png_byte**,int,int,int,double,char*,int,int);
+/* on x86-64 with gcc, build AVX2 and SSE4.2 versions of the sample
+ * projection kernel and pick one at load time, so one binary runs anywhere */
+#if defined(__GNUC__) && !defined(__clang__) && defined(__x86_64__) && defined(__linux__)
+  #define SIMD_CLONES __attribute__((target_clones("avx2","sse4.2","default")))
+#else
+  #define SIMD_CLONES
+#endif
+
+png_byte* allocate_png_buffer(int,int,int);
+int write_png_image(png_byte*,size_t,int,int,int,double,int,char*,int,int);
+static FILE* open_image_file(const char*,const char*,const char*,int,int);
 
 // define the possible rendering types
 typedef enum render_type {
@@ -55,6 +65,159 @@ typedef enum render_type {
    edges        // render triangle edges only
 } RENDER;
 
+/*
+ * The accumulation buffer: all layers in one aligned allocation, each
+ * layer stored row by row (constant y, x fastest), so that a row of
+ * pixels is contiguous both for splatting and for the png writer.
+ * Values are floats or, to halve the memory of tall -layers stacks,
+ * IEEE half floats (about 3 significant digits, max 65504); halves are
+ * stored multiplied by "scale" to keep the sums in range.
+ */
+typedef struct accum_record {
+   int nx, ny, nl;		// pixels in x and y, number of layers
+   size_t layer_size;		// nx*ny
+   int use_half;		// store as half floats?
+   float scale;			// half floats hold value*scale
+   float *f;			// the data, if floats
+   unsigned short *h;		// the data, if half floats
+} ACCUM;
+
+/* convert a float to a half float, saturating at 65504; normal values
+ * round up with probability equal to the dropped fraction when "rnd" is
+ * uniform in 0..8191 (stochastic rounding), or to nearest when rnd<0 */
+static inline unsigned short float_to_half (const float val, const int rnd) {
+   union { float f; unsigned int u; } in = { val };
+   const unsigned int sign = (in.u >> 16) & 0x8000;
+   const unsigned int absu = in.u & 0x7fffffff;
+
+   // NaN stays NaN
+   if (absu > 0x7f800000) return (unsigned short)(sign | 0x7e00);
+   // too large (or inf), clamp to largest finite value
+   if (absu >= 0x477ff000) return (unsigned short)(sign | 0x7bff);
+   // normal half
+   if (absu >= 0x38800000) {
+      const unsigned int mant = absu & 0x007fffff;
+      unsigned int h = ((absu >> 23) - 112) << 10 | (mant >> 13);
+      const unsigned int rem = mant & 0x1fff;
+      if (rnd < 0) {
+         // round to nearest even
+         if (rem > 0x1000 || (rem == 0x1000 && (h & 1))) h++;
+      } else {
+         // round up sometimes, so that many small additions do not stall
+         if (rem > (unsigned int)rnd) h++;
+      }
+      // carry into the exponent is fine, up to the largest finite half
+      if (h > 0x7bff) h = 0x7bff;
+      return (unsigned short)(sign | h);
+   }
+   // subnormal half, or zero
+   if (absu < 0x33000000) return (unsigned short)sign;
+   const unsigned int shift = 126 - (absu >> 23);
+   const unsigned int mant = (absu & 0x007fffff) | 0x00800000;
+   unsigned int h = mant >> shift;
+   const unsigned int rem = mant & ((1u << shift) - 1);
+   const unsigned int half = 1u << (shift - 1);
+   if (rem > half || (rem == half && (h & 1))) h++;
+   return (unsigned short)(sign | h);
+}
+
+/* convert a half float to a float, exactly */
+static inline float half_to_float (const unsigned short val) {
+   union { unsigned int u; float f; } out;
+   const unsigned int sign = (unsigned int)(val & 0x8000) << 16;
+   const unsigned int expo = (val >> 10) & 0x1f;
+   const unsigned int mant = val & 0x03ff;
+   if (expo == 0x1f) {
+      out.u = sign | 0x7f800000 | (mant << 13);
+   } else if (expo != 0) {
+      out.u = sign | ((expo + 112) << 23) | (mant << 13);
+   } else if (mant == 0) {
+      out.u = sign;
+   } else {
+      // subnormal half is a normal float
+      out.f = (float)mant * (1.0f / 16777216.0f);
+      out.u |= sign;
+   }
+   return out.f;
+}
+
+/*
+ * Sums of thousands of splats would stall if each were rounded to the
+ * nearest half, so additions round stochastically; the random number is
+ * a hash of the pixel and the sum, so a given run order is repeatable.
+ * The half paths are kept out of line to keep the float splat loop tight.
+ */
+static void acc_add_half (ACCUM* acc, const size_t idx, const double val) {
+   union { float f; unsigned int u; } sum;
+   sum.f = half_to_float(acc->h[idx]) + (float)val * acc->scale;
+   unsigned int hash = (unsigned int)idx * 0x9e3779b1u ^ sum.u;
+   hash ^= hash >> 15;
+   hash *= 0x2c1b3c6du;
+   hash ^= hash >> 12;
+   acc->h[idx] = float_to_half(sum.f, (int)(hash & 0x1fff));
+}
+
+static void acc_set_half (ACCUM* acc, const size_t idx, const double val) {
+   acc->h[idx] = float_to_half((float)val * acc->scale, -1);
+}
+
+static float acc_get_half (const ACCUM* acc, const size_t idx) {
+   return half_to_float(acc->h[idx]) / acc->scale;
+}
+
+static inline float acc_get (const ACCUM* acc, const int l, const int i, const int j) {
+   const size_t idx = (size_t)l*acc->layer_size + (size_t)j*acc->nx + (size_t)i;
+   if (__builtin_expect(acc->use_half, 0)) return acc_get_half(acc, idx);
+   return acc->f[idx];
+}
+
+static inline void acc_set (ACCUM* acc, const int l, const int i, const int j, const double val) {
+   const size_t idx = (size_t)l*acc->layer_size + (size_t)j*acc->nx + (size_t)i;
+   if (__builtin_expect(acc->use_half, 0)) acc_set_half(acc, idx, val);
+   else acc->f[idx] = val;
+}
+
+static inline void acc_add (ACCUM* acc, const int l, const int i, const int j, const double val) {
+   const size_t idx = (size_t)l*acc->layer_size + (size_t)j*acc->nx + (size_t)i;
+   if (__builtin_expect(acc->use_half, 0)) acc_add_half(acc, idx, val);
+   else acc->f[idx] += val;
+}
+
+/*
+ * allocate the accumulation buffer for nl layers of nx by ny pixels
+ */
+int allocate_accum (ACCUM* acc, int nx, int ny, int nl, int use_half, float scale) {
+
+   const size_t elem = use_half ? sizeof(unsigned short) : sizeof(float);
+   void* ptr = NULL;
+
+   acc->nx = nx;
+   acc->ny = ny;
+   acc->nl = nl;
+   acc->layer_size = (size_t)nx * (size_t)ny;
+   acc->use_half = use_half;
+   acc->scale = scale;
+   acc->f = NULL;
+   acc->h = NULL;
+
+   if (posix_memalign(&ptr, 64, (size_t)nl * acc->layer_size * elem) != 0) {
+      fprintf(stderr,"\nCould not allocate %d layers of %d x %d pixels, quitting.\n",nl,nx,ny);
+      exit(1);
+   }
+   if (use_half) acc->h = (unsigned short*)ptr;
+   else acc->f = (float*)ptr;
+
+   return(0);
+}
+
+int free_accum (ACCUM* acc) {
+   if (acc->use_half) free(acc->h);
+   else free(acc->f);
+   acc->f = NULL;
+   acc->h = NULL;
+   return(0);
+}
+
 /* Function to find minimum of x and y */
 int min(int x, int y)
 {
@@ -104,6 +267,475 @@ double minimum_distance(double vx, double vy, double vz,
   return sqrt( pow(jx-px,2) + pow(jy-py,2) + pow(jz-pz,2) );
 }
 
+/*
+ * Squared distances from the segment v-w to a run of num points at
+ * (px, py0+j), for j=0..num-1, all in the image plane; the squares of
+ * what minimum_distance returns with z=0, but branch-free so that it
+ * vectorizes (the sqrt is left to the caller, as it would not vectorize
+ * without -fno-math-errno)
+ */
+SIMD_CLONES
+static void segment_dist_row (const double vx, const double vy,
+      const double wx, const double wy, const double px, const double py0,
+      const int num, double* restrict dist) {
+
+   const double l2 = pow(vx-wx,2) + pow(vy-wy,2);
+   const double den = (l2 > 0.0) ? l2 : 1.0;
+
+#pragma omp simd
+   for (int j=0; j<num; j++) {
+      const double py = py0 + (double)j;
+
+      // parameter of the projection onto the line, as in minimum_distance
+      const double t = (l2 > 0.0) ? ( (px-vx)*(wx-vx) + (py-vy)*(wy-vy) ) / den : 0.0;
+
+      // nearest point on the segment
+      const double jx = (t < 0.0) ? vx : ((t > 1.0) ? wx : vx + t * (wx - vx));
+      const double jy = (t < 0.0) ? vy : ((t > 1.0) ? wy : vy + t * (wy - vy));
+      dist[j] = pow(jx-px,2) + pow(jy-py,2);
+   }
+}
+
+/*
+ * Project one row of sub-triangle sample points into the image
+ *
+ * The samples in row "i" of a triangle split into "subdivisions" rows
+ * sit at integer barycentric weights (A,B,C)/D of the three nodes, so
+ * their image coordinates are the same weights applied to the nodes'
+ * image coordinates (px,py,pz, already shifted by xmin,ymin,zmin and by
+ * this normal layer's displacement). This loop has no dependencies and
+ * runs 4 (AVX2) or 2 (SSE) samples at a time; the splat stays scalar.
+ *
+ * Outputs are, per sample j in 0..2i, the lower-left pixel (xloc,yloc),
+ * the position within that pixel (xfr,yfr), and the depth (zpos).
+ */
+SIMD_CLONES
+static void project_sample_row (const int i, const int subdivisions,
+      const double* restrict px, const double* restrict py, const double* restrict pz,
+      const double dd, int* restrict xloc, int* restrict yloc,
+      double* restrict xfr, double* restrict yfr, double* restrict zpos) {
+
+   const int D = 3*subdivisions;
+   const int num = 2*i+1;
+
+#pragma omp simd
+   for (int j=0; j<num; j++) {
+      // even j are upright sub-tris, odd j are inverted ones
+      const int odd = j & 1;
+      const int A = 3*(subdivisions-i) - 2 + odd;
+      const int B = 3*(i - ((j+1)>>1)) + 1 + odd;
+      const int C = D-A-B;
+
+      const double xpos = (A*px[0] + B*px[1] + C*px[2]) / (double)(D) / dd;
+      const double ypos = (A*py[0] + B*py[1] + C*py[2]) / (double)(D) / dd;
+      zpos[j] = (A*pz[0] + B*pz[1] + C*pz[2]) / (double)(D);
+
+      // lower-left pixel coordinate (be able to accept negative quantities)
+      const double xf = floor(xpos);
+      const double yf = floor(ypos);
+      xloc[j] = (int)xf;
+      yloc[j] = (int)yf;
+      xfr[j] = xpos - xf;
+      yfr[j] = ypos - yf;
+   }
+}
+
+/*
+ * Add weight "w" to layer 0 at the four pixels around a sample in pixel
+ * (xloc,yloc) at fractional position (xpos,ypos), skipping any off-image
+ */
+static inline void splat_bilinear (ACCUM* acc, const int xloc, const int yloc,
+      const double xpos, const double ypos, const double w) {
+
+   if (xloc > -1 && xloc < acc->nx) {
+      double rtemp = w*(1.0-xpos);
+      if (yloc > -1 && yloc < acc->ny)
+         acc_add(acc, 0, xloc, yloc, rtemp*(1.0-ypos));
+      if (yloc > -2 && yloc+1 < acc->ny)
+         acc_add(acc, 0, xloc, yloc+1, rtemp*(ypos));
+   }
+   if (xloc > -2 && xloc+1 < acc->nx) {
+      double rtemp = w*(xpos);
+      if (yloc > -1 && yloc < acc->ny)
+         acc_add(acc, 0, xloc+1, yloc, rtemp*(1.0-ypos));
+      if (yloc > -2 && yloc+1 < acc->ny)
+         acc_add(acc, 0, xloc+1, yloc+1, rtemp*(ypos));
+   }
+}
+
+/*
+ * For slab-ordered rendering: a triangle and the highest layer it can
+ * touch; ties keep the input order so that runs are repeatable
+ */
+typedef struct tri_depth_record {
+   int top;
+   int idx;
+   tri_pointer tri;
+} TRI_DEPTH;
+
+static int compare_depth (const void* p1, const void* p2) {
+   const TRI_DEPTH* t1 = (const TRI_DEPTH*)p1;
+   const TRI_DEPTH* t2 = (const TRI_DEPTH*)p2;
+   if (t1->top != t2->top) return (t2->top - t1->top);
+   return (t1->idx - t2->idx);
+}
+
+/*
+ * Finish one layer of a slab-ordered render: add in the volume carry
+ * (all splats from layers above, see write_xray), gamma-correct, append
+ * the layer to the spill file, and clear its slot in the ring for reuse.
+ * Returns the peak value of the layer.
+ */
+static float flush_layer (ACCUM* a, ACCUM* d, float* carry, const int layer,
+      const double gamma, const double initval, float* buf, FILE* spill) {
+
+   const int slot = layer % a->nl;
+   float maxval = 0.;
+
+   for (int j=0; j<a->ny; j++) {
+      for (int i=0; i<a->nx; i++) {
+         const size_t idx = (size_t)j*a->nx + (size_t)i;
+         float val = acc_get(a, slot, i, j);
+         if (carry) {
+            val += carry[idx];
+            carry[idx] += acc_get(d, slot, i, j);
+            acc_set(d, slot, i, j, 0.0);
+         }
+         val = exp(gamma*log(val));
+         buf[idx] = val;
+         if (val > maxval) maxval = val;
+         acc_set(a, slot, i, j, initval);
+      }
+   }
+
+   if (fwrite(buf, sizeof(float), a->layer_size, spill) != a->layer_size) {
+      fprintf(stderr,"\nCould not write layer %d to the spill file, quitting.\n",layer);
+      exit(1);
+   }
+
+   return(maxval);
+}
+
+/*
+ * Tone-map the accumulated layers and write them out
+ *
+ * "a" holds the raw sums, or if "spill" is given, the layers were already
+ *    gamma-corrected and written to that file top-down, and "maxval" is
+ *    their peak value; "a" may then hold fewer than "num_images" layers
+ * everything after that is as in write_xray
+ */
+static int write_layers (ACCUM* a, FILE* spill, float maxval, int num_images, RENDER rtype,
+      double gamma, double peak_crop, int write_hibit, char* output_format,
+      char* prefix, int png_level, int force_num_threads) {
+
+   const int xres = a->nx;
+   const int yres = a->ny;
+   int write_pgm;			// write an ASCII PGM file
+   int write_png;			// write a PNG file
+   int write_bin;			// write a binary (uncompressed) PGM file
+   int write_raw;			// write raw float32 pixels
+
+   // set the desired output format
+   write_pgm = FALSE;
+   write_png = FALSE;
+   write_bin = FALSE;
+   write_raw = FALSE;
+   if (strncmp(output_format, "pgm", 3) == 0) {
+      write_pgm = TRUE;
+   } else if (strncmp(output_format, "bin", 3) == 0) {
+      write_bin = TRUE;
+   } else if (strncmp(output_format, "raw", 3) == 0) {
+      write_raw = TRUE;
+   } else if (strncmp(output_format, "png", 3) == 0) {
+      write_png = TRUE;
+   } else {
+      //fprintf(stderr,"WARNING (write_xray): output file format (%s)\n",output_format);
+      //fprintf(stderr,"  unrecognized. Writing PNG by default.\n");
+      write_png = TRUE;
+   }
+   const char* format_name = write_pgm ? "PGM" : (write_bin ? "binary PGM" : (write_raw ? "raw float" : "PNG"));
+
+   if (num_images == 1)
+      fprintf(stderr,"Writing %s image", format_name);
+   else
+      fprintf(stderr,"Writing %d %s images", num_images, format_name);
+   fflush(stderr);
+
+   // gamma-correct and check for peak value (unless the layers were
+   //    finished and spilled, already gamma-corrected)
+   if (!spill) {
+      for (int inum=0; inum<num_images; inum++) {
+         for (int j=0; j<yres; j++) {
+            for (int i=0; i<xres; i++) {
+               const float val = exp(gamma*log(acc_get(a, inum, i, j)));
+               acc_set(a, inum, i, j, val);
+               if (val > maxval) maxval = val;
+            }
+         }
+      }
+   }
+
+   // peak cropping is now a command-line option
+   fprintf(stderr,", maxval is %g",maxval);
+   if (rtype == surface) {
+      maxval *= peak_crop;
+      fprintf(stderr,", peak-cropped maxval is %g",maxval);
+   }
+   fprintf(stderr,"\n"); fflush(stderr);
+
+   // layers are independent, so scale and encode them concurrently,
+   //    each thread with its own staging buffers
+   const int depth = write_hibit ? 16 : 8;
+   const size_t stride = (size_t)xres * (write_hibit ? 2 : 1);
+#ifdef _OPENMP
+   int num_out_threads = (force_num_threads > 0) ? force_num_threads : omp_get_num_procs();
+   if (num_out_threads > num_images) num_out_threads = num_images;
+#endif
+
+#pragma omp parallel num_threads(num_out_threads)
+{
+   // one contiguous staging image, rows are top-down (j reversed)
+   png_byte* img = NULL;
+   float* lay_buf = NULL;
+   float* row_buf = NULL;
+   if (write_png || write_bin) img = allocate_png_buffer(xres,yres,depth);
+   if (spill || a->use_half) lay_buf = (float*)malloc(a->layer_size*sizeof(float));
+   if (write_raw) row_buf = (float*)malloc(xres*sizeof(float));
+
+   // scale values and write files, one layer at a time
+#pragma omp for schedule(dynamic,1)
+   for (int inum=0; inum<num_images; inum++) {
+
+      // find this layer's gamma-corrected values, row by row
+      const float* lay;
+      if (spill) {
+         // layers were spilled top-down
+         const off_t pos = (off_t)(num_images-1-inum) * (off_t)(a->layer_size*sizeof(float));
+         int ok;
+#pragma omp critical (spill_read)
+         ok = (fseeko(spill, pos, SEEK_SET) == 0 &&
+               fread(lay_buf, sizeof(float), a->layer_size, spill) == a->layer_size);
+         if (!ok) {
+            fprintf(stderr,"\nCould not read layer %d from the spill file, quitting.\n",inum);
+            exit(1);
+         }
+         lay = lay_buf;
+      } else if (a->use_half) {
+         for (int j=0; j<yres; j++)
+            for (int i=0; i<xres; i++)
+               lay_buf[(size_t)j*xres+i] = acc_get(a, inum, i, j);
+         lay = lay_buf;
+      } else {
+         lay = a->f + (size_t)inum*a->layer_size;
+      }
+
+      if (write_pgm) {
+
+         FILE* ofp = open_image_file(prefix, "_s", "pgm", inum, num_images);
+         if (ofp == NULL) continue;
+
+         if (write_hibit) {
+            // write header
+            fprintf(ofp,"P2\n%d %d\n%d\n",xres,yres,65535);
+            // write data
+            for (int j=yres-1; j>-1; j--) {
+               for (int i=0; i<xres; i++) {
+                  int printval = (int)(lay[(size_t)j*xres+i]*65536.0/maxval);
+                  if (printval > 65535) printval = 65535;
+                  fprintf(ofp,"%d\n",printval);
+               }
+            }
+         } else {
+            // write header
+            fprintf(ofp,"P2\n%d %d\n%d\n",xres,yres,255);
+            // write data
+            for (int j=yres-1; j>-1; j--) {
+               for (int i=0; i<xres; i++) {
+                  int printval = (int)(lay[(size_t)j*xres+i]*256.0/maxval);
+                  if (printval > 255) printval = 255;
+                  fprintf(ofp,"%d\n",printval);
+               }
+            }
+         }
+
+         if (ofp != stdout) fclose(ofp);
+
+      } else if (write_raw) {
+
+         // unclipped floats, 1.0 is full white, rows top-down
+         FILE* ofp = open_image_file(prefix, "_", "raw", inum, num_images);
+         if (ofp == NULL) continue;
+         for (int j=yres-1; j>-1; j--) {
+            const float* src = lay + (size_t)j*xres;
+            for (int i=0; i<xres; i++) row_buf[i] = src[i]/maxval;
+            fwrite(row_buf, sizeof(float), xres, ofp);
+         }
+         if (ofp != stdout) fclose(ofp);
+
+      } else {
+
+         // png and binary pgm share the same big-endian sample layout
+         for (int j=yres-1; j>-1; j--) {
+            png_byte* row = img + (size_t)(yres-1-j)*stride;
+            const float* src = lay + (size_t)j*xres;
+            if (write_hibit) {
+               for (int i=0; i<xres; i++) {
+                  int printval = (int)(src[i]*65536.0/maxval);
+                  if (printval<0) printval = 0;
+                  if (printval>65535) printval = 65535;
+                  row[2*i] = (png_byte)(printval/256);
+                  row[2*i+1] = (png_byte)(printval%256);
+               }
+            } else {
+               for (int i=0; i<xres; i++) {
+                  int printval = (int)(src[i]*256.0/maxval);
+                  if (printval<0) printval = 0;
+                  if (printval>255) printval = 255;
+                  row[i] = (png_byte)printval;
+               }
+            }
+         }
+
+         if (write_bin) {
+            FILE* ofp = open_image_file(prefix, "_s", "pgm", inum, num_images);
+            if (ofp == NULL) continue;
+            fprintf(ofp,"P5\n%d %d\n%d\n",xres,yres,write_hibit ? 65535 : 255);
+            fwrite(img, 1, stride*yres, ofp);
+            if (ofp != stdout) fclose(ofp);
+         } else {
+            write_png_image(img,stride,xres,yres,depth,gamma,png_level,prefix,inum,num_images);
+         }
+      }
+   }
+
+   free(img);
+   free(lay_buf);
+   free(row_buf);
+} // end omp section
+
+   if (write_raw) fprintf(stderr,"Raw images are %d x %d native-endian float32\n",xres,yres);
+
+   return(0);
+}
+
+
+/*
+ * The tone-mapping cache lets an image be re-written with new -g, -pc,
+ * -8/-16, -fade and output format settings without re-rendering:
+ *    8 bytes   "RXCACHE1"
+ *    6 ints    xres, yres, num_images, render type, -fade, has_alt
+ *    18 doubles   vx, vy, vz (image basis), xmin, xmax, ymin, ymax,
+ *              zmin, zmax (bounds), dd, ddz (pixel and layer sizes)
+ *    floats    num_images layers of xres*yres raw sums, rows of constant y
+ *    floats    if has_alt, the one layer rendered with the other -fade
+ * all in native byte order
+ */
+#define CACHE_MAGIC "RXCACHE1"
+
+static int write_accum_layer (FILE* fp, const ACCUM* acc, const int l) {
+   if (!acc->use_half)
+      return (fwrite(acc->f + (size_t)l*acc->layer_size, sizeof(float), acc->layer_size, fp) == acc->layer_size);
+   float* row = (float*)malloc(acc->nx*sizeof(float));
+   int ok = TRUE;
+   for (int j=0; j<acc->ny && ok; j++) {
+      for (int i=0; i<acc->nx; i++) row[i] = acc_get(acc, l, i, j);
+      ok = (fwrite(row, sizeof(float), acc->nx, fp) == (size_t)acc->nx);
+   }
+   free(row);
+   return (ok);
+}
+
+static int write_xray_cache (const char* cache_file, const ACCUM* a, const ACCUM* alt,
+      RENDER rtype, int is_fade, VEC vx, VEC vy, VEC vz, double xmin, double xmax,
+      double ymin, double ymax, double zmin, double zmax, double dd, double ddz) {
+
+   FILE* fp = fopen(cache_file, "wb");
+   if (fp == NULL) {
+      fprintf(stderr,"Could not open cache file %s, skipping\n",cache_file);
+      return(1);
+   }
+
+   const int hdr[6] = {a->nx, a->ny, a->nl, (int)rtype, is_fade, (alt != NULL)};
+   const double view[18] = {vx.x, vx.y, vx.z, vy.x, vy.y, vy.z, vz.x, vz.y, vz.z,
+                            xmin, xmax, ymin, ymax, zmin, zmax, dd, ddz, 0.0};
+   int ok = (fwrite(CACHE_MAGIC, 1, 8, fp) == 8 &&
+             fwrite(hdr, sizeof(int), 6, fp) == 6 &&
+             fwrite(view, sizeof(double), 18, fp) == 18);
+   for (int l=0; l<a->nl && ok; l++) ok = write_accum_layer(fp, a, l);
+   if (alt && ok) ok = write_accum_layer(fp, alt, 0);
+   fclose(fp);
+
+   if (!ok) {
+      fprintf(stderr,"Could not write cache file %s\n",cache_file);
+      return(1);
+   }
+   fprintf(stderr,"Wrote raw image sums to %s\n",cache_file);
+   return(0);
+}
+
+/*
+ * Re-write the image(s) saved in a cache file by write_xray, applying
+ * only the tone mapping; arguments are as in write_xray
+ */
+int retone_xray (char* cache_file, double peak_crop, double gamma, int write_hibit,
+      int is_fade, char* prefix, char* output_format, int force_num_threads, int png_level) {
+
+   char magic[8];
+   int hdr[6];
+   double view[18];
+   ACCUM a;
+
+   FILE* fp = fopen(cache_file, "rb");
+   if (fp == NULL) {
+      fprintf(stderr,"Could not open cache file %s\n",cache_file);
+      return(1);
+   }
+   if (fread(magic, 1, 8, fp) != 8 || strncmp(magic, CACHE_MAGIC, 8) != 0 ||
+       fread(hdr, sizeof(int), 6, fp) != 6 ||
+       fread(view, sizeof(double), 18, fp) != 18 ||
+       hdr[0] < 1 || hdr[1] < 1 || hdr[2] < 1 || hdr[3] < (int)surface || hdr[3] > (int)edges) {
+      fprintf(stderr,"File %s is not a rockxray cache\n",cache_file);
+      fclose(fp);
+      return(1);
+   }
+   const int xres = hdr[0];
+   const int yres = hdr[1];
+   const int num_images = hdr[2];
+   const RENDER rtype = (RENDER)hdr[3];
+   const int cached_fade = hdr[4];
+   const int has_alt = hdr[5];
+   fprintf(stderr,"Cached image is %d x %d pixels, %d layer(s), view %g %g %g\n",
+           xres,yres,num_images,view[6],view[7],view[8]);
+   fprintf(stderr,"  and image geometry bounds %g/%g and %g/%g\n",view[9],view[10],view[11],view[12]);
+
+   (void) allocate_accum(&a, xres, yres, num_images, FALSE, 1.0);
+
+   // -fade only changes single surface and volume images, and those
+   //    caches carry both versions
+   int ok = TRUE;
+   if (has_alt && is_fade != cached_fade)
+      ok = (fseeko(fp, (off_t)a.layer_size*sizeof(float), SEEK_CUR) == 0);
+   else if (is_fade != cached_fade)
+      fprintf(stderr,"  -fade does not change this image\n");
+   if (ok) ok = (fread(a.f, sizeof(float), (size_t)num_images*a.layer_size, fp) == (size_t)num_images*a.layer_size);
+   fclose(fp);
+   if (!ok) {
+      fprintf(stderr,"Cache file %s is truncated\n",cache_file);
+      (void) free_accum(&a);
+      return(1);
+   }
+
+   // multiple layers never go to stdout
+   if (num_images > 1 && !prefix) prefix = "out";
+
+   (void) write_layers(&a, NULL, 0., num_images, rtype, gamma, peak_crop, write_hibit,
+                       output_format, prefix, png_level, force_num_threads);
+
+   (void) free_accum(&a);
+   return(0);
+}
+
+
 /*
  * Write a PGM image of the xray of the shell of a mesh
  *
@@ -112,18 +744,22 @@ double minimum_distance(double vx, double vy, double vz,
  * "thick" is the thickness of the mesh, in world units
  * "square" forces a square image, and centers the object (TRUE|FALSE)
  * "thisq" sets quality (0=low, 1=med, 2=high, 3=very high)
+ * "slab" renders multiple layers in depth order, holding only as many
+ *    layers as the deepest triangle spans (TRUE|FALSE)
+ * "png_level" is the zlib compression level, 0-9, or -1 for the default
+ * "cache_file", if not NULL, receives the raw sums for retone_xray
  */
 int write_xray (tri_pointer tri_head, VEC vz, double *xb, double *yb, double *zb, int size,
       double thick, int square, double border, int thisq, double peak_crop, double gamma,
       int write_hibit, RENDER rtype, int is_fade, int num_images, char* prefix, char* output_format,
-      int force_num_threads) {
+      int force_num_threads, int use_half, int slab, int png_level, char* cache_file) {
 
-   int write_pgm;			// write a PGM file
-   int write_png;			// write a PNG file
    int cnt;
    int xres,yres;			// the actual image size
-   float ***a;				// the array to print
-   png_byte **img = NULL;		// the png array
+   ACCUM a;				// the array to print
+   ACCUM d;				// slab mode: volume splats for all layers below
+   float *carry = NULL;			// slab mode: sum of d over flushed layers
+   FILE *spill = NULL;			// slab mode: finished, gamma-corrected layers
    double xsize,ysize,zsize,dd;
    double ddz = 1.0;
    double xmin,xmax,ymin,ymax;		// bounds of the image
@@ -139,20 +775,6 @@ int write_xray (tri_pointer tri_head, VEC vz, double *xb, double *yb, double *zb
    if (debug_write)
      debug_out = fopen("temp", "w");
 
-   // set the desired output format
-   if (strncmp(output_format, "pgm", 3) == 0) {
-      write_pgm = TRUE;
-      write_png = FALSE;
-   } else if (strncmp(output_format, "png", 3) == 0) {
-      write_png = TRUE;
-      write_pgm = FALSE;
-   } else {
-      //fprintf(stderr,"WARNING (write_xray): output file format (%s)\n",output_format);
-      //fprintf(stderr,"  unrecognized. Writing PNG by default.\n");
-      write_png = TRUE;
-      write_pgm = FALSE;
-   }
-
    // now, actually create the image //
 
    // first, find the three basis vectors: screen-x, screen-y, z (vz)
@@ -305,24 +927,104 @@ int write_xray (tri_pointer tri_head, VEC vz, double *xb, double *yb, double *zb
    }
 
 
-   // allocate the array(s)
-   a = (float***)malloc(num_images*sizeof(float**));
-   for (int i=0; i<num_images; i++) {
-      a[i] = allocate_2d_array_f(xres,yres);
+   // gather the triangles into an array, which the threads will split
+   int num_tris = 0;
+   this_tri = tri_head;
+   while (this_tri) {
+      num_tris++;
+      this_tri = this_tri->next_tri;
    }
-   
+   tri_pointer* tri_list = (tri_pointer*)malloc(num_tris*sizeof(tri_pointer));
+   int* tri_top = NULL;
+   this_tri = tri_head;
+   for (int it=0; it<num_tris; it++) {
+      tri_list[it] = this_tri;
+      this_tri = this_tri->next_tri;
+   }
+
+   // slab mode: sort the triangles by the highest layer they can touch;
+   //    once all triangles reaching layer n are done, it can be written
+   //    out, and only the layers spanned by one triangle need be kept
+   if (slab && (num_images < 2 || rtype == edges)) slab = FALSE;
+   int num_slots = num_images;
+   if (slab) {
+      TRI_DEPTH* td = (TRI_DEPTH*)malloc(num_tris*sizeof(TRI_DEPTH));
+      tri_top = (int*)malloc(num_tris*sizeof(int));
+      int max_span = 0;
+      for (int it=0; it<num_tris; it++) {
+         double minpos = 9.9e+9;
+         double maxpos = -9.9e+9;
+         for (int i=0; i<3; i++) {
+            const double pos = dot(vz,tri_list[it]->node[i]->loc) - zmin;
+            if (pos > maxpos) maxpos = pos;
+            if (pos < minpos) minpos = pos;
+         }
+         // splats reach zloc+1, pad one more layer each way for roundoff
+         int top = (int)floor((maxpos+thick)/ddz) + 2;
+         int bot = (int)floor((minpos-thick)/ddz) - 1;
+         if (top > num_images-1) top = num_images-1;
+         if (bot < 0) bot = 0;
+         if (top-bot > max_span) max_span = top-bot;
+         td[it].top = top;
+         td[it].idx = it;
+         td[it].tri = tri_list[it];
+      }
+      qsort(td, num_tris, sizeof(TRI_DEPTH), compare_depth);
+      for (int it=0; it<num_tris; it++) {
+         tri_list[it] = td[it].tri;
+         tri_top[it] = td[it].top;
+      }
+      free(td);
+
+      num_slots = max_span + 1;
+      if (num_slots > num_images) num_slots = num_images;
+      fprintf(stderr,"Rendering %d layers through a window of %d\n",num_images,num_slots);
+   }
+
+   // allocate the array(s); densities are scaled by 1e+5 below, which
+   //   would overflow half floats, but depths and edge values will not
+   //   (in slab mode, layer n lives in slot n%num_slots)
+   const float half_scale = (rtype == surface || rtype == volume) ? 1.e-5 : 1.0;
+   (void) allocate_accum(&a, xres, yres, num_slots, use_half, half_scale);
 
    // appropriately initialize the array(s)
-   if (rtype == last) {
-      for (int inum=0; inum<num_images; inum++)
+   const double initval = (rtype == last) ? 9.9e+9 : 0.0;
+   for (int inum=0; inum<num_slots; inum++)
+      for (int j=0; j<yres; j++)
          for (int i=0; i<xres; i++)
-           for (int j=0; j<yres; j++)
-              a[inum][i][j] = 9.9e+9;
-   } else {
-      for (int inum=0; inum<num_images; inum++)
+            acc_set(&a, inum, i, j, initval);
+
+   // a cache of a single surface or volume image also keeps the image
+   //    with the opposite -fade setting, so either can be re-toned later
+   const int keep_alt = (cache_file && !slab && num_images == 1 &&
+                         (rtype == surface || rtype == volume));
+   ACCUM alt;
+   if (keep_alt) {
+      (void) allocate_accum(&alt, xres, yres, 1, use_half, half_scale);
+      for (int j=0; j<yres; j++)
          for (int i=0; i<xres; i++)
-           for (int j=0; j<yres; j++)
-              a[inum][i][j] = 0.0;
+            acc_set(&alt, 0, i, j, 0.0);
+   }
+
+   // volume renders add to every layer below the splat; in slab mode,
+   //    store that once per pixel in d, and sum it as layers are flushed
+   float* flush_buf = NULL;
+   float maxval = 0.;
+   if (slab) {
+      if (rtype == volume) {
+         (void) allocate_accum(&d, xres, yres, num_slots, use_half, half_scale);
+         for (int inum=0; inum<num_slots; inum++)
+            for (int j=0; j<yres; j++)
+               for (int i=0; i<xres; i++)
+                  acc_set(&d, inum, i, j, 0.0);
+         carry = (float*)calloc(a.layer_size, sizeof(float));
+      }
+      spill = tmpfile();
+      if (spill == NULL) {
+         fprintf(stderr,"\nCould not open a temporary file for finished layers, quitting.\n");
+         exit(1);
+      }
+      flush_buf = (float*)malloc(a.layer_size*sizeof(float));
    }
 
 
@@ -355,44 +1057,48 @@ int write_xray (tri_pointer tri_head, VEC vz, double *xb, double *yb, double *zb
       lock_max[i] = ((i+1)*yres)/num_locks - 1;
       //fprintf(stderr,"\n lock %d from %d to %d",i,lock_min[i],lock_max[i]); fflush(stderr);
    }
-
-   // finally, set equal-spaced tri_head for each thread
-   // we will not need to do this if OpenMP could do task-parallel (it can)
-   tri_pointer tri_heads[num_threads+1];
-   // first loop: just count
-   cnt = 0;
-   this_tri = tri_head;
-   while (this_tri) {
-      this_tri = this_tri->next_tri;
-      cnt++;
-   }
-   int tris_per_thread = cnt/num_threads;
-   // second loop: set pointers
-   cnt = 0;
-   this_tri = tri_head;
-   while (this_tri) {
-      if (++cnt%tris_per_thread == 1) {
-         //fprintf(stderr,"\n mark tri %d number %d",cnt,cnt/tris_per_thread); fflush(stderr);
-         tri_heads[cnt/tris_per_thread] = this_tri;
-      }
-      this_tri = this_tri->next_tri;
-   }
-   tri_heads[num_threads] = NULL;
+#else
+   const int num_threads = 1;
 #endif
+   int thread_cnt[num_threads];
+   for (int i=0; i<num_threads; i++) thread_cnt[i] = 0;
+
+   // march through the triangles in batches: one batch of everything,
+   //    or in slab mode, all triangles sharing a top layer
+   int next_flush = num_images-1;	// highest layer not yet written out
+   int batch_start = 0;
+   while (batch_start < num_tris) {
+   int batch_end = num_tris;
+   if (slab) {
+      batch_end = batch_start+1;
+      while (batch_end < num_tris && tri_top[batch_end] == tri_top[batch_start]) batch_end++;
+   }
 
    // begin parallel section
-   // how do we have each thread march through the same linked list?
-   // i.e. each thread grabs the next triangle and processes it
+   // each thread takes an equal, contiguous run of the batch
 #pragma omp parallel private(cnt,this_tri)
 {
-   cnt = 0;
 #ifdef _OPENMP
-   this_tri = tri_heads[omp_get_thread_num()];
-   while (this_tri != tri_heads[omp_get_thread_num()+1]) {
+   const int tid = omp_get_thread_num();
+   const int nthr = omp_get_num_threads();
 #else
-   this_tri = tri_head;
-   while (this_tri) {
+   const int tid = 0;
+   const int nthr = 1;
 #endif
+   const int it_start = batch_start + (int)(((long)tid*(batch_end-batch_start))/nthr);
+   const int it_end = batch_start + (int)(((long)(tid+1)*(batch_end-batch_start))/nthr);
+   cnt = thread_cnt[tid];
+
+   // per-thread scratch for one row of projected samples, grown as needed
+   int row_cap = 0;
+   int *sxloc = NULL;
+   int *syloc = NULL;
+   double *sxfr = NULL;
+   double *syfr = NULL;
+   double *szpos = NULL;
+
+   for (int it=it_start; it<it_end; it++) {
+      this_tri = tri_list[it];
 
       // first, see if the triangle is anywhere near the actual view window
 
@@ -408,7 +1114,6 @@ int write_xray (tri_pointer tri_head, VEC vz, double *xb, double *yb, double *zb
       if ((int)(floor((maxpos+thick)/dd)) < -1 ||
           (int)(floor((minpos-thick)/dd)) > xres+1) {
          // skip this tri
-         this_tri = this_tri->next_tri;
          continue;
       }
 
@@ -424,9 +1129,12 @@ int write_xray (tri_pointer tri_head, VEC vz, double *xb, double *yb, double *zb
       if ((int)(floor((maxpos+thick)/dd)) < -1 ||
           (int)(floor((minpos-thick)/dd)) > yres+1) {
          // skip this tri
-         this_tri = this_tri->next_tri;
          continue;
       }
+#ifdef _OPENMP
+      const double yminpos = minpos;
+      const double ymaxpos = maxpos;
+#endif
 
       // finally, check in z-direction
       minpos = 9.9e+9;
@@ -440,14 +1148,14 @@ int write_xray (tri_pointer tri_head, VEC vz, double *xb, double *yb, double *zb
       if ((maxpos+thick) < 0.0 ||
           (minpos-thick) > zsize) {
          // skip this tri
-         this_tri = this_tri->next_tri;
          continue;
       }
 
       // use y-array coordinates to determine which lock(s) to get;
 #ifdef _OPENMP
-      int lowbound = floor((minpos-thick)/dd) - 0;
-      int highbound = floor((maxpos+thick)/dd) + 1;
+      // (locks cover bands of image rows, which are contiguous in memory)
+      int lowbound = floor((yminpos-thick)/dd) - 1;
+      int highbound = floor((ymaxpos+thick)/dd) + 1;
       //if (omp_get_thread_num() == 0) fprintf(stderr,"\n lowbound %d   highbound %d",lowbound,highbound); fflush(stderr);
       // loop through locks, grabbing the right ones
       for (int i=0; i<num_locks; i++ ) {
@@ -483,20 +1191,32 @@ int write_xray (tri_pointer tri_head, VEC vz, double *xb, double *yb, double *zb
             const int jmin = max((int)floor(fmin(y1-rad, y2-rad)) - 1, 0);
             const int jmax = min((int)ceil(fmax(y1+rad, y2+rad)) + 1, yres);
 
+            // scratch for one column of squared distances
+            if (jmax-jmin > row_cap) {
+               row_cap = jmax-jmin;
+               sxloc = (int*)realloc(sxloc, 2*row_cap*sizeof(int));
+               syloc = sxloc + row_cap;
+               sxfr = (double*)realloc(sxfr, 3*row_cap*sizeof(double));
+               syfr = sxfr + row_cap;
+               szpos = sxfr + 2*row_cap;
+            }
+
             // loop over all pixels in the edge
             for (int i=imin; i<imax; i++) {
+            if (jmax > jmin) segment_dist_row(x1,y1, x2,y2, (double)i+0.5, (double)jmin+0.5, jmax-jmin, sxfr);
             for (int j=jmin; j<jmax; j++) {
                // if dist is less than thick
                // 3d version
                //const double thisDist = minimum_distance(x1,y1,z1, x2,y2,z2, (double)i+0.5,(double)j+0.5,(double)k+0.5) - rad;
                // 2d version
-               const float thisDist = minimum_distance(x1,y1,0.0, x2,y2,0.0, (double)i+0.5,(double)j+0.5,0.0) - rad;
+               //const float thisDist = minimum_distance(x1,y1,0.0, x2,y2,0.0, (double)i+0.5,(double)j+0.5,0.0) - rad;
+               const float thisDist = sqrt(sxfr[j-jmin]) - rad;
                // add fraction to total, cap at 1.0
                // only update the array if this voxel is nearer to this segment
                float thisVal = 0.f;
                if (thisDist < -1.f) thisVal = 1.f;
                else if (thisDist < 1.f) thisVal = 1.f - 0.5f*(1.f+thisDist);
-               if (thisVal > a[0][i][j]) a[0][i][j] = thisVal;
+               if (thisVal > acc_get(&a, 0, i, j)) acc_set(&a, 0, i, j, thisVal);
             }
             }
          }
@@ -512,7 +1232,6 @@ int write_xray (tri_pointer tri_head, VEC vz, double *xb, double *yb, double *zb
       const double area = find_area(this_tri);
       if (isnan(area)) {
          fprintf(stderr,"\nfound tri with nan area, skipping");
-         this_tri = this_tri->next_tri;
          continue;
       }
       double sidelen = sqrt(area);
@@ -542,9 +1261,6 @@ int write_xray (tri_pointer tri_head, VEC vz, double *xb, double *yb, double *zb
          trinorm.z *= 0.5*thick;
       }
 
-      // reset D to be 3*subdivisions
-      const int D = 3*subdivisions;
-
       // base density is a scaled area measure
       double factor = (1.e+5)*area/(double)(subdivisions*subdivisions)/(dd*dd);
       if (rtype == volume) { 
@@ -558,46 +1274,52 @@ int write_xray (tri_pointer tri_head, VEC vz, double *xb, double *yb, double *zb
       }
 
 
+      // grow the per-thread sample row scratch space
+      if (2*subdivisions > row_cap) {
+         row_cap = 2*subdivisions;
+         sxloc = (int*)realloc(sxloc, 2*row_cap*sizeof(int));
+         syloc = sxloc + row_cap;
+         sxfr = (double*)realloc(sxfr, 3*row_cap*sizeof(double));
+         syfr = sxfr + row_cap;
+         szpos = sxfr + 2*row_cap;
+      }
+
       // put the value on the grid by subdivision
       for (int k=0; k<num_norm_layers; k++) {
 
       // displacement of given layer in normal dir.
       const double norm_disp = (double)(2*k+1)/(double)(num_norm_layers) - 1.0;
 
+      // find node locations in image coordinates (vx, vy, vz are normalized),
+      //    perturbed in the triangle-normal direction
+      VEC ec[3];
+      double px[3],py[3],pz[3];
+      for (int in=0; in<3; in++) {
+         ec[in].x = this_tri->node[in]->loc.x + trinorm.x*norm_disp;
+         ec[in].y = this_tri->node[in]->loc.y + trinorm.y*norm_disp;
+         ec[in].z = this_tri->node[in]->loc.z + trinorm.z*norm_disp;
+         px[in] = dot(vx,ec[in]) - xmin;
+         py[in] = dot(vy,ec[in]) - ymin;
+         pz[in] = dot(vz,ec[in]) - zmin;
+      }
+
       for (int i=0; i<subdivisions; i++) {
 
+         // project this whole row of sub-tri centers at once
+         project_sample_row(i, subdivisions, px, py, pz, dd, sxloc, syloc, sxfr, syfr, szpos);
+
          for (int j=0; j<(2*i+1); j++) {
 
-            int A,B,C;
-            if (j%2 == 0) {
-               A = 3*(subdivisions-i)-2;
-               B = (i-j/2)*3+1;
-               C = D-A-B;
-            } else {
-               A = 3*(subdivisions-i)-1;
-               B = (i-(j+1)/2)*3+2;
-               C = D-A-B;
-            }
-            VEC ec;
-            ec.x = (A*n0->loc.x+B*n1->loc.x+C*n2->loc.x)/(double)(D);
-            ec.y = (A*n0->loc.y+B*n1->loc.y+C*n2->loc.y)/(double)(D);
-            ec.z = (A*n0->loc.z+B*n1->loc.z+C*n2->loc.z)/(double)(D);
-            // fprintf(stderr,"   point at %g %g %g\n",ec.x,ec.y,ec.z);
-
-            // and perturb it in the triangle-normal direction
-            ec.x += trinorm.x*norm_disp;
-            ec.y += trinorm.y*norm_disp;
-            ec.z += trinorm.z*norm_disp;
-
-            // find location in image coordinates (vx, vy, vz are normalized)
-            double xpos = dot(vx,ec) - xmin;
-            double ypos = dot(vy,ec) - ymin;
-            double zpos = dot(vz,ec) - zmin;
+            double zpos = szpos[j];
 
 #ifdef USE_GAUSSIAN
             fprintf(stderr,"GAUSSIAN kernel unsupports with multiple layers\n");
             exit(1);
 
+            // location in image units
+            const double xpos = dd*(sxloc[j] + sxfr[j]);
+            const double ypos = dd*(syloc[j] + syfr[j]);
+
             // circle of confusion radius in image units (sigma)
             const double rad = fabs(zpos-0.45) + dd;
             const double cnst = 1./pow(rad,2);
@@ -622,7 +1344,7 @@ int write_xray (tri_pointer tri_head, VEC vz, double *xb, double *yb, double *zb
                      const double dy = ypos - iy*dd;
                      const double dr = drr + pow(dy,2);
                      //fprintf(stderr,"  %d %d  %g %g  %g\n",ix,iy,dx,dy,dr);
-                     a[0][ix][iy] += factor*cnst*exp(-0.5*dr*cnst);
+                     acc_add(&a, 0, ix, iy, factor*cnst*exp(-0.5*dr*cnst));
                   }
                }
                      //exit(0);
@@ -634,14 +1356,11 @@ int write_xray (tri_pointer tri_head, VEC vz, double *xb, double *yb, double *zb
             // only draw this one if zpos is within range (we already subtracted zmin)
             if (zpos > 0.0 && zpos < zsize) {
 
-            // find lower-left pixel coordinate (be able to accept negative quantities)
-            const int xloc = (int)(floor(xpos/dd));
-            const int yloc = (int)(floor(ypos/dd));
-            //if (omp_get_thread_num() == 0) fprintf(stderr,"   which is %g %g, cell %d %d\n",xpos,ypos,xloc,yloc);
-
-            // reset xpos, ypos as local cell coordinates
-            xpos = xpos/dd - xloc;
-            ypos = ypos/dd - yloc;
+            // lower-left pixel coordinate and local cell coordinates
+            const int xloc = sxloc[j];
+            const int yloc = syloc[j];
+            const double xpos = sxfr[j];
+            const double ypos = syfr[j];
             // if (xpos < 0 || ypos < 0)
                // fprintf(stderr,"   subcell coords %g %g, weight %g\n",xpos,ypos,factor);
 
@@ -652,30 +1371,30 @@ int write_xray (tri_pointer tri_head, VEC vz, double *xb, double *yb, double *zb
                double rtemp = zpos;
                if (xloc > -1 && xloc < xres) {
                   if (yloc > -1 && yloc < yres)
-                     if (rtemp > a[0][xloc][yloc]) a[0][xloc][yloc] = rtemp;
+                     if (rtemp > acc_get(&a, 0, xloc, yloc)) acc_set(&a, 0, xloc, yloc, rtemp);
                   if (yloc > -2 && yloc+1 < yres)
-                     if (rtemp > a[0][xloc][yloc+1]) a[0][xloc][yloc+1] = rtemp;
+                     if (rtemp > acc_get(&a, 0, xloc, yloc+1)) acc_set(&a, 0, xloc, yloc+1, rtemp);
                }
                if (xloc > -2 && xloc+1 < xres) {
                   if (yloc > -1 && yloc < yres)
-                     if (rtemp > a[0][xloc+1][yloc]) a[0][xloc+1][yloc] = rtemp;
+                     if (rtemp > acc_get(&a, 0, xloc+1, yloc)) acc_set(&a, 0, xloc+1, yloc, rtemp);
                   if (yloc > -2 && yloc+1 < yres)
-                     if (rtemp > a[0][xloc+1][yloc+1]) a[0][xloc+1][yloc+1] = rtemp;
+                     if (rtemp > acc_get(&a, 0, xloc+1, yloc+1)) acc_set(&a, 0, xloc+1, yloc+1, rtemp);
                }
 
               } else if (rtype == last) {
                double rtemp = zpos;
                if (xloc > -1 && xloc < xres) {
                   if (yloc > -1 && yloc < yres)
-                     if (rtemp < a[0][xloc][yloc]) a[0][xloc][yloc] = rtemp;
+                     if (rtemp < acc_get(&a, 0, xloc, yloc)) acc_set(&a, 0, xloc, yloc, rtemp);
                   if (yloc > -2 && yloc+1 < yres)
-                     if (rtemp < a[0][xloc][yloc+1]) a[0][xloc][yloc+1] = rtemp;
+                     if (rtemp < acc_get(&a, 0, xloc, yloc+1)) acc_set(&a, 0, xloc, yloc+1, rtemp);
                }
                if (xloc > -2 && xloc+1 < xres) {
                   if (yloc > -1 && yloc < yres)
-                     if (rtemp < a[0][xloc+1][yloc]) a[0][xloc+1][yloc] = rtemp;
+                     if (rtemp < acc_get(&a, 0, xloc+1, yloc)) acc_set(&a, 0, xloc+1, yloc, rtemp);
                   if (yloc > -2 && yloc+1 < yres)
-                     if (rtemp < a[0][xloc+1][yloc+1]) a[0][xloc+1][yloc+1] = rtemp;
+                     if (rtemp < acc_get(&a, 0, xloc+1, yloc+1)) acc_set(&a, 0, xloc+1, yloc+1, rtemp);
                }
 
               } else {
@@ -689,19 +1408,12 @@ int write_xray (tri_pointer tri_head, VEC vz, double *xb, double *yb, double *zb
                   rfactor *= zpos;
                }
 
-               if (xloc > -1 && xloc < xres) {
-                  double rtemp = rfactor*(1.0-xpos);
-                  if (yloc > -1 && yloc < yres)
-                     a[0][xloc][yloc]     += rtemp*(1.0-ypos);
-                  if (yloc > -2 && yloc+1 < yres)
-                     a[0][xloc][yloc+1]   += rtemp*(ypos);
-               }
-               if (xloc > -2 && xloc+1 < xres) {
-                  double rtemp = rfactor*(xpos);
-                  if (yloc > -1 && yloc < yres)
-                     a[0][xloc+1][yloc]   += rtemp*(1.0-ypos);
-                  if (yloc > -2 && yloc+1 < yres)
-                     a[0][xloc+1][yloc+1] += rtemp*(ypos);
+               splat_bilinear(&a, xloc, yloc, xpos, ypos, rfactor);
+
+               // when caching, also keep the image for the other -fade choice
+               if (keep_alt) {
+                  const double afactor = is_fade ? rfactor/zpos : rfactor*zpos;
+                  splat_bilinear(&alt, xloc, yloc, xpos, ypos, afactor);
                }
               }
 
@@ -716,8 +1428,11 @@ int write_xray (tri_pointer tri_head, VEC vz, double *xb, double *yb, double *zb
                //if (zloc != 0) fprintf(stderr,"zloc %d  where zpos %g and ddz %g\n",zloc,zpos,ddz);
 
                // only continue of zloc can point to a valid layer
-               if (zloc > -1 || zloc < num_images-1) {
+               if (zloc > -1 && zloc < num_images-1) {
                zpos = zpos/ddz - zloc;
+               // in slab mode, layers sit in a ring of slots
+               const int zs0 = zloc % a.nl;
+               const int zs1 = (zloc+1) % a.nl;
                double rtemp = 0.0;
                double stemp = 0.0;
 
@@ -734,34 +1449,38 @@ int write_xray (tri_pointer tri_head, VEC vz, double *xb, double *yb, double *zb
                      rtemp = rfactor*(1.0-xpos);
                      if (yloc > -1 && yloc < yres) {
                         stemp = rtemp*(1.0-ypos);
-                        a[zloc+1][xloc][yloc]     += stemp*zsq;
-                        a[zloc][xloc][yloc]       += stemp*zinv;
-                        for (int inum=zloc-1; inum>-1; inum--)
-                           a[inum][xloc][yloc]    += stemp*2.0;
+                        acc_add(&a, zs1, xloc, yloc, stemp*zsq);
+                        acc_add(&a, zs0, xloc, yloc, stemp*zinv);
+                        if (slab) acc_add(&d, zs0, xloc, yloc, stemp*2.0);
+                        else for (int inum=zloc-1; inum>-1; inum--)
+                           acc_add(&a, inum, xloc, yloc, stemp*2.0);
                      }
                      if (yloc > -2 && yloc+1 < yres) {
                         stemp = rtemp*(ypos);
-                        a[zloc+1][xloc][yloc+1]   += stemp*zsq;
-                        a[zloc][xloc][yloc+1]     += stemp*zinv;
-                        for (int inum=zloc-1; inum>-1; inum--)
-                           a[inum][xloc][yloc+1]  += stemp*2.0;
+                        acc_add(&a, zs1, xloc, yloc+1, stemp*zsq);
+                        acc_add(&a, zs0, xloc, yloc+1, stemp*zinv);
+                        if (slab) acc_add(&d, zs0, xloc, yloc+1, stemp*2.0);
+                        else for (int inum=zloc-1; inum>-1; inum--)
+                           acc_add(&a, inum, xloc, yloc+1, stemp*2.0);
                      }
                   }
                   if (xloc > -2 && xloc+1 < xres) {
                      rtemp = rfactor*(xpos);
                      if (yloc > -1 && yloc < yres) {
                         stemp = rtemp*(1.0-ypos);
-                        a[zloc+1][xloc+1][yloc]   += stemp*zsq;
-                        a[zloc][xloc+1][yloc]     += stemp*zinv;
-                        for (int inum=zloc-1; inum>-1; inum--)
-                           a[inum][xloc+1][yloc]  += stemp*2.0;
+                        acc_add(&a, zs1, xloc+1, yloc, stemp*zsq);
+                        acc_add(&a, zs0, xloc+1, yloc, stemp*zinv);
+                        if (slab) acc_add(&d, zs0, xloc+1, yloc, stemp*2.0);
+                        else for (int inum=zloc-1; inum>-1; inum--)
+                           acc_add(&a, inum, xloc+1, yloc, stemp*2.0);
                      }
                      if (yloc > -2 && yloc+1 < yres) {
                         stemp = rtemp*(ypos);
-                        a[zloc+1][xloc+1][yloc+1] += stemp*zsq;
-                        a[zloc][xloc+1][yloc+1]   += stemp*zinv;
-                        for (int inum=zloc-1; inum>-1; inum--)
-                           a[inum][xloc+1][yloc+1]+= stemp*2.0;
+                        acc_add(&a, zs1, xloc+1, yloc+1, stemp*zsq);
+                        acc_add(&a, zs0, xloc+1, yloc+1, stemp*zinv);
+                        if (slab) acc_add(&d, zs0, xloc+1, yloc+1, stemp*2.0);
+                        else for (int inum=zloc-1; inum>-1; inum--)
+                           acc_add(&a, inum, xloc+1, yloc+1, stemp*2.0);
                      }
                   }
 
@@ -771,26 +1490,26 @@ int write_xray (tri_pointer tri_head, VEC vz, double *xb, double *yb, double *zb
                      rtemp = rfactor*(1.0-xpos);
                      if (yloc > -1 && yloc < yres) {
                         stemp = rtemp*(1.0-ypos);
-                        a[zloc][xloc][yloc]       += stemp*(1.0-zpos);
-                        a[zloc+1][xloc][yloc]     += stemp*(zpos);
+                        acc_add(&a, zs0, xloc, yloc, stemp*(1.0-zpos));
+                        acc_add(&a, zs1, xloc, yloc, stemp*(zpos));
                      }
                      if (yloc > -2 && yloc+1 < yres) {
                         stemp = rtemp*(ypos);
-                        a[zloc][xloc][yloc+1]     += stemp*(1.0-zpos);
-                        a[zloc+1][xloc][yloc+1]   += stemp*(zpos);
+                        acc_add(&a, zs0, xloc, yloc+1, stemp*(1.0-zpos));
+                        acc_add(&a, zs1, xloc, yloc+1, stemp*(zpos));
                      }
                   }
                   if (xloc > -2 && xloc+1 < xres) {
                      rtemp = rfactor*(xpos);
                      if (yloc > -1 && yloc < yres) {
                         stemp = rtemp*(1.0-ypos);
-                        a[zloc][xloc+1][yloc]     += stemp*(1.0-zpos);
-                        a[zloc+1][xloc+1][yloc]   += stemp*(zpos);
+                        acc_add(&a, zs0, xloc+1, yloc, stemp*(1.0-zpos));
+                        acc_add(&a, zs1, xloc+1, yloc, stemp*(zpos));
                      }
                      if (yloc > -2 && yloc+1 < yres) {
                         stemp = rtemp*(ypos);
-                        a[zloc][xloc+1][yloc+1]   += stemp*(1.0-zpos);
-                        a[zloc+1][xloc+1][yloc+1] += stemp*(zpos);
+                        acc_add(&a, zs0, xloc+1, yloc+1, stemp*(1.0-zpos));
+                        acc_add(&a, zs1, xloc+1, yloc+1, stemp*(zpos));
                      }
                   }
 
@@ -821,183 +1540,130 @@ int write_xray (tri_pointer tri_head, VEC vz, double *xb, double *yb, double *zb
          fprintf(stderr,".");
          fflush(stderr);
       }
-
-      this_tri = this_tri->next_tri;
    }
-#ifdef _OPENMP
-   fprintf(stderr,"\nThread %d wrote %d triangles",omp_get_thread_num(), cnt);
-#endif
+   thread_cnt[tid] = cnt;
+   free(sxloc);
+   free(sxfr);
 
 } // end omp section
-   fprintf(stderr,"\n");
-
-   if (debug_write)
-     fclose(debug_out);
-
-   // finally, print the image
 
-   float maxval = 0.;
-   if (write_pgm) {
+   batch_start = batch_end;
 
-      if (num_images == 1) 
-         fprintf(stderr,"Writing PGM image");
-      else
-         fprintf(stderr,"Writing %d PGM images", num_images);
-      fflush(stderr);
-
-      // gamma-correct and check for peak value
-      for (int inum=0; inum<num_images; inum++) {
-         for (int j=yres-1; j>-1; j--) {
-            for (int i=0; i<xres; i++) {
-               a[inum][i][j] = exp(gamma*log(a[inum][i][j]));
-               if (a[inum][i][j] > maxval) maxval = a[inum][i][j];
-            }
-         }
-      }
-      fprintf(stderr,", maxval is %g\n",maxval); fflush(stderr);
-
-      // peak cropping is now a command-line option
-      fprintf(stderr,", maxval is %g",maxval);
-      if (rtype == surface) {
-         maxval *= peak_crop;
-         fprintf(stderr,", peak-cropped maxval is %g",maxval);
+   // slab mode: no remaining triangle reaches above its top layer, so
+   //    all layers above that are finished
+   if (slab) {
+      const int top_live = (batch_start < num_tris) ? tri_top[batch_start] : -1;
+      for (; next_flush > top_live; next_flush--) {
+         const float lmax = flush_layer(&a, &d, carry, next_flush, gamma, initval, flush_buf, spill);
+         if (lmax > maxval) maxval = lmax;
       }
-      fprintf(stderr,"\n"); fflush(stderr);
-
-      // scale values and write files
-      for (int inum=0; inum<num_images; inum++) {
+   }
+   } // end loop over batches
 
-         FILE* ofp;
-         if (num_images == 1) {
-            if (!prefix) {
-               ofp = stdout;
-            } else {
-               char file_name[MAX_FN_LEN];
-               sprintf(file_name, "%s.pgm", prefix);
-               ofp = fopen(file_name, "wb");
-            }
-         } else {
-            char file_name[MAX_FN_LEN];
-            sprintf(file_name, "%s_s%02d.pgm", prefix, inum);
-            ofp = fopen(file_name, "wb");
-         }
+#ifdef _OPENMP
+   for (int i=0; i<num_threads; i++)
+      fprintf(stderr,"\nThread %d wrote %d triangles", i, thread_cnt[i]);
+#endif
+   fprintf(stderr,"\n");
+   free(tri_list);
+   free(tri_top);
+   free(flush_buf);
+   if (carry) {
+      free(carry);
+      (void) free_accum(&d);
+   }
 
-         if (write_hibit) {
-            // write header
-            fprintf(ofp,"P2\n%d %d\n%d\n",xres,yres,65535);
-            // write data
-            for (int j=yres-1; j>-1; j--) {
-               for (int i=0; i<xres; i++) {
-                  int printval = (int)(a[inum][i][j]*65536.0/maxval);
-                  if (printval > 65535) printval = 65535;
-                  fprintf(ofp,"%d\n",printval);
-               }
-            }
-         } else {
-            // write header
-            fprintf(ofp,"P2\n%d %d\n%d\n",xres,yres,255);
-            // write data
-            for (int j=yres-1; j>-1; j--) {
-               for (int i=0; i<xres; i++) {
-                  int printval = (int)(a[inum][i][j]*256.0/maxval);
-                  if (printval > 255) printval = 255;
-                  fprintf(ofp,"%d\n",printval);
-               }
-            }
-         }
+   if (debug_write)
+     fclose(debug_out);
 
-         if (num_images != 1) {
-            fclose(ofp);
-         }
-      }
+   // save the raw sums before any tone mapping
+   if (cache_file) {
+      if (slab) fprintf(stderr,"Cannot cache a -slab render, skipping %s\n",cache_file);
+      else (void) write_xray_cache(cache_file, &a, keep_alt ? &alt : NULL, rtype, is_fade,
+                                   vx, vy, vz, xmin, xmax, ymin, ymax, zmin, zmax, dd, ddz);
+   }
+   if (keep_alt) (void) free_accum(&alt);
+
+   // finally, print the image; called from a parallel region (multi-view
+   //    runs), this encodes while the caller goes on to render the next
+   //    view, otherwise the task runs right here; wait for the last one
+   //    first, so that no more than two views are held at once
+   char* task_prefix = NULL;
+   if (prefix) {
+      task_prefix = (char*)malloc(strlen(prefix)+1);
+      strcpy(task_prefix, prefix);
+   }
+   // while overlapped, encode only on the cores the next render leaves idle
+   int out_threads = force_num_threads;
+#ifdef _OPENMP
+   if (out_threads < 1 && omp_in_parallel()) {
+      out_threads = omp_get_num_procs() - num_threads;
+      if (out_threads < 1) out_threads = 1;
+   }
+#endif
+#pragma omp taskwait
+#pragma omp task firstprivate(a,spill,maxval,task_prefix,out_threads)
+{
+   (void) write_layers(&a, spill, maxval, num_images, rtype, gamma, peak_crop, write_hibit,
+                       output_format, task_prefix, png_level, out_threads);
 
-   } else if (write_png) {
+   if (slab) fclose(spill);
+   (void) free_accum(&a);
+   free(task_prefix);
+} // end omp task
 
-      if (num_images == 1) 
-         fprintf(stderr,"Writing PNG image");
-      else
-         fprintf(stderr,"Writing %d PNG images", num_images);
-      fflush(stderr);
+   /* replace the old list with the new list */
+   return(0);
+}
 
-      // gamma-correct and check for peak value
-      for (int inum=0; inum<num_images; inum++) {
-         for (int i=0; i<xres; i++) {
-            for (int j=0; j<yres; j++) {
-               a[inum][i][j] = exp(gamma*log(a[inum][i][j]));
-               if (a[inum][i][j] > maxval) maxval = a[inum][i][j];
-            }
-         }
-      }
 
-      fprintf(stderr,", maxval is %g",maxval);
-      if (rtype == surface) {
-         maxval *= peak_crop;
-         fprintf(stderr,", peak-cropped maxval is %g",maxval);
-      }
-      fprintf(stderr,"\n"); fflush(stderr);
+/*
+ * allocate one aligned, contiguous block for a png image of nx by ny
+ * pixels; rows are nx*bytesperpixel apart
+ */
+png_byte* allocate_png_buffer(int nx, int ny, int depth) {
 
-      // scale all values
-      if (write_hibit) {
-         img = allocate_2d_array_pb(xres,yres,16);
-         for (int inum=0; inum<num_images; inum++) {
-            for (int j=yres-1; j>-1; j--) {
-               for (int i=0; i<xres; i++) {
-                  int printval = (int)(a[inum][i][j]*65536.0/maxval);
-                  if (printval<0) printval = 0;
-                  if (printval>65535) printval = 65535;
-                  img[yres-1-j][2*i] = (png_byte)(printval/256);
-                  img[yres-1-j][2*i+1] = (png_byte)(printval%256);
-               }
-            }
-            write_png_image(img,yres,xres,16,gamma,prefix,inum,num_images);
-         }
-      } else {
-         img = allocate_2d_array_pb(xres,yres,8);
-         for (int inum=0; inum<num_images; inum++) {
-            for (int j=yres-1; j>-1; j--) {
-               for (int i=0; i<xres; i++) {
-                  int printval = (int)(a[inum][i][j]*256.0/maxval);
-                  if (printval<0) printval = 0;
-                  if (printval>255) printval = 255;
-                  img[yres-1-j][i] = (png_byte)printval;
-               }
-            }
-            write_png_image(img,yres,xres,8,gamma,prefix,inum,num_images);
-         }
-      }
+   int bytesperpixel;
+   void *array = NULL;
 
+   if (depth <= 8) bytesperpixel = 1;
+   else bytesperpixel = 2;
+   if (posix_memalign(&array, 64, (size_t)bytesperpixel * nx * ny * sizeof(png_byte)) != 0) {
+      fprintf(stderr,"\nCould not allocate %d x %d png image, quitting.\n",nx,ny);
+      exit(1);
    }
 
-   /* replace the old list with the new list */
-   return(0);
+   return((png_byte*)array);
 }
 
 
 /*
- * allocate memory for a two-dimensional array of png_byte
+ * open the file for image "img_num" of "num_images": a lone image goes
+ * to stdout unless there is a prefix, several go to prefix, sep, number
  */
-png_byte** allocate_2d_array_pb(int nx, int ny, int depth) {
-
-   int i,bytesperpixel;
-   png_byte **array;
+static FILE* open_image_file (const char* prefix, const char* sep, const char* ext,
+      const int img_num, const int num_images) {
 
-   if (depth <= 8) bytesperpixel = 1;
-   else bytesperpixel = 2;
-   array = (png_byte **)malloc(ny * sizeof(png_byte *));
-   array[0] = (png_byte *)malloc(bytesperpixel * nx * ny * sizeof(png_byte));
+   char file_name[MAX_FN_LEN];
+   FILE *fp;
 
-   for (i=1; i<ny; i++)
-      array[i] = array[0] + i * bytesperpixel * nx;
+   if (num_images == 1) {
+      if (!prefix) return stdout;
+      sprintf(file_name, "%s.%s", prefix, ext);
+   } else {
+      sprintf(file_name, "%s%s%02d.%s", prefix, sep, img_num, ext);
+   }
 
-   return(array);
+   fp = fopen(file_name, "wb");
+   if (fp == NULL) fprintf(stderr,"\nCould not open %s for writing\n",file_name);
+   return (fp);
 }
 
 
 /*
- * write a png file
+ * write a png file, at zlib compression "level" (-1 is the default)
  */
-// int write_png_image(char *file_name,png_byte** image,int xres,int yres,int depth) {
-int write_png_image(png_byte** image,int xres,int yres,int depth,double gamma,char *prefix,int img_num,int num_images) {
+int write_png_image(png_byte* image,size_t stride,int xres,int yres,int depth,double gamma,int level,char *prefix,int img_num,int num_images) {
 
    png_uint_32 height,width;
    FILE *fp;
@@ -1005,27 +1671,15 @@ int write_png_image(png_byte** image,int xres,int yres,int depth,double gamma,ch
    png_infop info_ptr;
    //png_colorp palette;
    //png_voidp user_error_ptr;
-   char file_name[MAX_FN_LEN];
 
    // if we were given a prefix, write to a file instead of stdout
-   if (num_images == 1) {
-      if (!prefix) {
-         fp = stdout;
-      } else {
-         char file_name[MAX_FN_LEN];
-         sprintf(file_name, "%s.png", prefix);
-         fp = fopen(file_name, "wb");
-      }
-   } else {
-      sprintf(file_name, "%s_%02d.png", prefix, img_num);
-      fp = fopen(file_name, "wb");
-   }
+   fp = open_image_file(prefix, "_", "png", img_num, num_images);
 
    if (fp == NULL)
       return (-1);
 
-   height=yres;
    width=xres;
+   height=yres;
 
    /* Create and initialize the png_struct with the desired error handler
     * functions.  If you want to use the default stderr and longjump method,
@@ -1066,6 +1720,12 @@ int write_png_image(png_byte** image,int xres,int yres,int depth,double gamma,ch
    /* set up the output control if you are using standard C streams */
    png_init_io(png_ptr, fp);
 
+   /* trade file size for speed; unfiltered rows deflate faster at low levels */
+   if (level >= 0) {
+      png_set_compression_level(png_ptr, level);
+      if (level < 2) png_set_filter(png_ptr, PNG_FILTER_TYPE_BASE, PNG_FILTER_NONE);
+   }
+
    /* Set the image information here.  Width and height are up to 2^31,
     * bit_depth is one of 1, 2, 4, 8, or 16, but valid values also depend on
     * the color_type selected. color_type is one of PNG_COLOR_TYPE_GRAY,
@@ -1074,7 +1734,7 @@ int write_png_image(png_byte** image,int xres,int yres,int depth,double gamma,ch
     * PNG_INTERLACE_ADAM7, and the compression_type and filter_type MUST
     * currently be PNG_COMPRESSION_TYPE_BASE and PNG_FILTER_TYPE_BASE. REQUIRED
     */
-   png_set_IHDR(png_ptr, info_ptr, height, width, depth, PNG_COLOR_TYPE_GRAY,
+   png_set_IHDR(png_ptr, info_ptr, width, height, depth, PNG_COLOR_TYPE_GRAY,
       PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE);
 
    /* Optional gamma chunk is strongly suggested if you have any guess
@@ -1085,9 +1745,9 @@ int write_png_image(png_byte** image,int xres,int yres,int depth,double gamma,ch
    /* Write the file header information.  REQUIRED */
    png_write_info(png_ptr, info_ptr);
 
-   /* One of the following output methods is REQUIRED */
-   // png_write_image(png_ptr, row_pointers);
-   png_write_image(png_ptr, image);
+   /* write the rows straight out of the contiguous buffer */
+   for (png_uint_32 j=0; j<height; j++)
+      png_write_row(png_ptr, image + j*stride);
 
    /* It is REQUIRED to call this to finish writing the rest of the file */
    png_write_end(png_ptr, info_ptr);
@@ -1096,7 +1756,7 @@ int write_png_image(png_byte** image,int xres,int yres,int depth,double gamma,ch
    png_destroy_write_struct(&png_ptr, &info_ptr);
 
    /* close the file, if it was a file */
-   if (num_images != 1) fclose(fp);
+   if (fp != stdout) fclose(fp);
 
    /* that's it */
    return (0);